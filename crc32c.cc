@@ -0,0 +1,72 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#include <immintrin.h>
+
+namespace file {
+namespace {
+
+// Reflected CRC-32C polynomial.
+const uint32_t kPolynomial = 0x82f63b78;
+
+struct Table {
+  uint32_t entries[256];
+
+  Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (crc & 1 ? kPolynomial : 0);
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+const Table table;
+
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const char* data,
+                                   size_t size);
+
+Crc32cFunction BestCrc32cFunction() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return Crc32cSse42;
+  }
+  return Crc32cSoftware;
+}
+
+const Crc32cFunction crc32c_function = BestCrc32cFunction();
+
+}  // namespace
+
+uint32_t Crc32cSoftware(uint32_t crc, const char* data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table.entries[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^
+        (crc >> 8);
+  }
+  return ~crc;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t Crc32cSse42(uint32_t crc, const char* data, size_t size) {
+  uint64_t crc64 = ~crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  uint32_t crc32 = crc64;
+  for (; size > 0; ++data, --size) {
+    crc32 = _mm_crc32_u8(crc32, *data);
+  }
+  return ~crc32;
+}
+
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size) {
+  return crc32c_function(crc, data, size);
+}
+
+}  // namespace file
@@ -0,0 +1,27 @@
+// CRC-32C (Castagnoli) checksums, the variant used by iSCSI, ext4 and most
+// storage formats.
+//
+// Crc32c() uses the SSE4.2 crc32 instruction if the CPU has it, which runs at
+// several GB/s, and a table driven version otherwise.  Both give the same
+// result.
+
+#ifndef INFINIPIC_CRC32C_H_
+#define INFINIPIC_CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace file {
+
+// Extend crc, the checksum of some preceding data or zero, with size bytes
+// of data.
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size);
+
+// The two implementations.  Crc32cSse42 may only be called on a CPU that
+// supports SSE4.2.
+uint32_t Crc32cSoftware(uint32_t crc, const char* data, size_t size);
+uint32_t Crc32cSse42(uint32_t crc, const char* data, size_t size);
+
+}  // namespace file
+
+#endif  // INFINIPIC_CRC32C_H_
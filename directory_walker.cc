@@ -0,0 +1,188 @@
+#include "directory_walker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace file {
+namespace {
+
+// The record returned by getdents64, which glibc does not declare.
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Large reads mean fewer round trips on network file systems.
+const size_t kDirentBufferSize = 1 << 16;
+
+}  // namespace
+
+struct DirectoryWalker::Directory {
+  explicit Directory(const std::string& path) : path(path), read(false) {}
+
+  // A file, or a subdirectory if subdirectory is set.
+  struct Entry {
+    std::string path;
+    std::unique_ptr<Directory> subdirectory;
+  };
+
+  const std::string path;
+  // Set once the directory was read, after which entries do not change
+  // until Next walks over them.
+  bool read;
+  // Sorted by name.
+  std::vector<Entry> entries;
+};
+
+DirectoryWalker::DirectoryWalker(util::ThreadPool* pool,
+                                 const std::string& root,
+                                 std::function<bool(const char*)> accept,
+                                 const std::set<std::string>& excluded)
+    : pool_(pool),
+      accept_(accept),
+      excluded_(excluded),
+      root_(new Directory(root)),
+      pending_(0),
+      found_(0),
+      stopping_(false) {
+  Position position = {root_.get(), 0};
+  stack_.push_back(position);
+  Schedule(root_.get());
+}
+
+DirectoryWalker::~DirectoryWalker() {
+  stopping_ = true;
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return pending_ == 0; });
+}
+
+bool DirectoryWalker::Next(std::string* path) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stack_.empty()) {
+    Directory* directory = stack_.back().directory;
+    changed_.wait(lock, [directory] { return directory->read; });
+    size_t next = stack_.back().next++;
+    if (next == directory->entries.size()) {
+      // Every entry of the directory was walked, so its whole subtree is
+      // read and no task refers to it any more.
+      stack_.pop_back();
+      if (stack_.empty()) {
+        root_.reset();
+      } else {
+        const Position& parent = stack_.back();
+        parent.directory->entries[parent.next - 1].subdirectory.reset();
+      }
+      continue;
+    }
+    Directory::Entry& entry = directory->entries[next];
+    if (entry.subdirectory) {
+      Position position = {entry.subdirectory.get(), 0};
+      stack_.push_back(position);
+      continue;
+    }
+    path->swap(entry.path);
+    return true;
+  }
+  return false;
+}
+
+bool DirectoryWalker::done() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_ == 0;
+}
+
+void DirectoryWalker::Schedule(Directory* directory) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
+  // Subdirectories are pushed on the current worker's own deque, so each
+  // worker goes depth first while others steal the oldest, largest subtrees.
+  pool_->Schedule([this, directory] { ReadDirectory(directory); });
+}
+
+void DirectoryWalker::ReadDirectory(Directory* directory) {
+  const std::string& path = directory->path;
+  // Names of the entries to walk, and whether they are directories.
+  std::vector<std::pair<std::string, bool>> names;
+  int fd = stopping_ ? -1 : open(path.c_str(),
+                                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 && !stopping_) {
+    std::cerr << "Failed to read directory " << path << ": "
+              << strerror(errno) << std::endl;
+  }
+  const std::string prefix =
+      !path.empty() && path.back() == '/' ? path : path + "/";
+  std::vector<char> buffer(fd >= 0 ? kDirentBufferSize : 0);
+  while (fd >= 0) {
+    long size = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (size <= 0) {
+      if (size < 0) {
+        std::cerr << "Failed to read directory " << path << ": "
+                  << strerror(errno) << std::endl;
+      }
+      break;
+    }
+    for (long offset = 0; offset < size;) {
+      const LinuxDirent64* entry =
+          reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+      offset += entry->d_reclen;
+      const char* name = entry->d_name;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        continue;
+      }
+      bool is_directory = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+        // Follows symbolic links, like the stat they replace did.
+        struct stat status;
+        is_directory = fstatat(fd, name, &status, 0) == 0 &&
+            S_ISDIR(status.st_mode);
+      }
+      if (is_directory ? excluded_.count(prefix + name) == 0
+                       : accept_(name)) {
+        names.push_back(std::make_pair(std::string(name), is_directory));
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  // getdents64 returns entries in an order that depends on the file system
+  // and its history, so sort them for a stable walk order.
+  std::sort(names.begin(), names.end());
+  std::vector<Directory::Entry> entries(names.size());
+  int64_t files = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (names[i].second) {
+      entries[i].subdirectory.reset(new Directory(prefix + names[i].first));
+      Schedule(entries[i].subdirectory.get());
+    } else {
+      entries[i].path = prefix + names[i].first;
+      ++files;
+    }
+  }
+
+  // Notify while holding the lock, as the walker may be destroyed as soon as
+  // the last directory is done.
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory->entries.swap(entries);
+  directory->read = true;
+  found_ += files;
+  --pending_;
+  changed_.notify_all();
+}
+
+}  // namespace file
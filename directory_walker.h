@@ -0,0 +1,95 @@
+// A parallel walk of a directory tree, for finding millions of photos on
+// slow (for example NFS mounted) file systems.
+//
+// Every directory is read by its own task on a ThreadPool, so that a worker
+// waiting for the file system does not hold up the others, and idle workers
+// steal whole subtrees from busy ones.  Directories are read with getdents64,
+// whose d_type tells files from directories without a stat per entry.  Only
+// entries of unknown type and symbolic links are stat'ed.
+//
+// Files are handed out while the walk goes on, but always in the same order:
+// that of a depth first walk visiting the entries of every directory sorted
+// by name.  A file is handed out once every directory before it in that
+// order was read.
+//
+// Example:
+//   file::DirectoryWalker walker(&pool, "/photos", IsJpeg, {});
+//   std::string path;
+//   while (walker.Next(&path)) Process(path);
+
+#ifndef INFINIPIC_DIRECTORY_WALKER_H_
+#define INFINIPIC_DIRECTORY_WALKER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace file {
+
+class DirectoryWalker {
+ public:
+  // Start walking the tree under root.  Files are reported if accept returns
+  // true for their name, and directories whose path is in excluded are not
+  // entered.  Paths are root followed by the names below it, separated by
+  // slashes.
+  DirectoryWalker(util::ThreadPool* pool, const std::string& root,
+                  std::function<bool(const char* name)> accept,
+                  const std::set<std::string>& excluded);
+
+  // Abandons the directories not read yet, and waits for those being read.
+  ~DirectoryWalker();
+
+  // Wait for the next file in walk order.  Returns false once every file has
+  // been returned.  Must only be called from one thread, which
+  // should not be a worker of the pool.
+  bool Next(std::string* path);
+
+  // The number of files found so far.
+  int64_t found() const { return found_; }
+
+  // True once every directory has been read.
+  bool done() const;
+
+ private:
+  // A directory, and once read its files and subdirectories.
+  struct Directory;
+
+  // The next entry of a directory to return or descend into.
+  struct Position {
+    Directory* directory;
+    size_t next;
+  };
+
+  // Read one directory, scheduling a task for every subdirectory.
+  void ReadDirectory(Directory* directory);
+
+  void Schedule(Directory* directory);
+
+  util::ThreadPool* const pool_;
+  const std::function<bool(const char*)> accept_;
+  const std::set<std::string> excluded_;
+
+  mutable std::mutex mutex_;
+  // Signalled when a directory is read.
+  std::condition_variable changed_;
+  std::unique_ptr<Directory> root_;
+  // The directories Next is in, from the root down.  Directories are freed
+  // once Next leaves them.
+  std::vector<Position> stack_;
+  // Directories scheduled but not read yet.
+  int pending_;
+  std::atomic<int64_t> found_;
+  std::atomic<bool> stopping_;
+};
+
+}  // namespace file
+
+#endif  // INFINIPIC_DIRECTORY_WALKER_H_
@@ -1,22 +1,41 @@
 #include <cstdint>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
 #include <iostream>
-#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <GL/gl.h>
+#include <X11/X.h>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/functional/hash.hpp>
-#include <boost/progress.hpp>
 #include <gflags/gflags.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include "directory_walker.h"
+#include "jpeg_decode.h"
+#include "pipeline.h"
 #include "recordio.h"
+#include "ssd.h"
+#include "thread_pool.h"
+#include "thumbnail_library.h"
+#include "tile_atlas.h"
+#include "tile_sampler.h"
 #include "window.h"
 
 DEFINE_string(image_directory, "",
@@ -29,124 +48,448 @@ DEFINE_bool(generate_thumbnails, true,
             "Generate small versions of all images, stored in icon_file.");
 DEFINE_string(thumbnail_file, "thumbnails.bin",
               "File for caching small versions of all images.");
+DEFINE_bool(incremental_thumbnails, true,
+            "When generating thumbnails, reuse the ones in thumbnail_file "
+            "for photos whose size and modification time did not change.");
+DEFINE_int32(checkpoint_seconds, 60,
+             "While generating thumbnails, flush the ones written so far to "
+             "disk this often, so an interrupted run can resume from them.");
+DEFINE_bool(compress_thumbnails, true,
+            "Compress thumbnail_file with zstd, which makes it faster to "
+            "load from slow disks.");
+DEFINE_bool(mapped_library, true,
+            "Load the library by memory mapping a copy of thumbnail_file, "
+            "written next to it with a .map suffix when missing or stale.");
+
+DEFINE_bool(fast_decode, true,
+            "Decode JPEGs at a reduced size when making thumbnails and "
+            "mosaics, instead of decoding at full resolution and shrinking.");
+DEFINE_int32(benchmark_decode, 0,
+             "If positive, compare the speed and output of fast and full "
+             "resolution decoding on this many photos from image_directory, "
+             "and exit.");
 
 DEFINE_string(single_image, "",
               "If set, only generate the mosaic for this image.");
 
-using boost::filesystem::directory_iterator;
-using boost::filesystem::is_directory;
-using boost::filesystem::path;
+DEFINE_int32(mosaic_grid_size, 80,
+             "Number of tiles across and down a mosaic, for example 200 for "
+             "posters or 20 for quick previews.");
+DEFINE_int32(mosaic_tile_width, 20,
+             "Width in pixels of the part of a photo matched by each tile.  "
+             "Photos are resized to mosaic_grid_size times the tile size.");
+DEFINE_int32(mosaic_tile_height, 15,
+             "Height in pixels of the part of a photo matched by each tile.");
+DEFINE_int32(mosaic_cache_size, 128,
+             "When zooming in, keep the mosaics of this many photos.");
+DEFINE_int32(threads, 0,
+             "Number of threads for generating thumbnails and matching "
+             "tiles, 0 to use every core.");
+
+DEFINE_string(ssd_kernel, "auto",
+              "Kernel used for comparing thumbnails, one of auto, scalar, "
+              "sse4.1 or avx2.  auto picks the fastest one for this CPU.");
+DEFINE_bool(verify_ssd_kernels, false,
+            "Check that all SSD kernels supported by this CPU agree with "
+            "the scalar reference, and exit.");
+DEFINE_bool(verify_tile_samplers, false,
+            "Check that the specialized kernels for reducing mosaic tiles "
+            "to thumbnail size agree with the generic one, and exit.");
+DEFINE_string(match_mode, "exhaustive",
+              "How to search for the closest thumbnail to each tile: "
+              "exhaustive compares every thumbnail in full, partial abandons "
+              "a thumbnail as soon as it can no longer be the best match, "
+              "vptree searches a vantage point tree index, pca and pq are "
+              "approximate and re-rank the closest candidates in a PCA "
+              "projection or by product quantized distance.");
+DEFINE_bool(match_mean_color_order, false,
+            "In partial match mode, visit thumbnails closest in mean color "
+            "first.");
+DEFINE_int32(pca_dims, 32,
+             "In pca match mode, the number of dimensions to project "
+             "thumbnails to.");
+DEFINE_int32(pca_candidates, 64,
+             "In pca match mode, the number of candidates to re-rank by "
+             "their exact difference.  More candidates give better matches.");
+DEFINE_int32(pq_subspaces, 0,
+             "If positive, train product quantization codes of this many "
+             "bytes per thumbnail when generating thumbnails, and store them "
+             "in thumbnail_file for pq match mode.  8 to 32 work well.");
+DEFINE_int32(pq_candidates, 16,
+             "In pq match mode, the number of candidates to re-rank by their "
+             "exact difference.");
+DEFINE_bool(measure_recall, false,
+            "For approximate match modes, check every match against an "
+            "exhaustive scan and print how often they agree.");
+
+// The layout of a mosaic: grid_size by grid_size tiles, each matched against
+// a tile_width by tile_height block of a photo resized to width() by
+// height() pixels.  Mosaics are drawn one unit per pixel of that photo.
+struct MosaicGeometry {
+  int grid_size;
+  int tile_width;
+  int tile_height;
 
-struct Thumbnail {
-  char filename[256];
-  uint8_t pixels[3 * 20 * 15];
+  int width() const { return grid_size * tile_width; }
+  int height() const { return grid_size * tile_height; }
 };
 
-class ThumbnailLibrary {
- public:
-  ThumbnailLibrary() {
+// Load a photo at the size mosaics are made from, with the bottom row first
+// as OpenGL expects.  Returns an empty image if the photo can not be read.
+cv::Mat LoadMosaicImage(const std::string& photo,
+                        const MosaicGeometry& geometry) {
+  cv::Mat image;
+  int width, height;
+  if (!FLAGS_fast_decode ||
+      !image::ReadJpegReduced(photo, geometry.width(), geometry.height(),
+                              &image, &width, &height)) {
+    image = cv::imread(photo, CV_LOAD_IMAGE_COLOR);
   }
-
-  void Add(const Thumbnail& thumbnail) {
-    thumbnails_.push_back(thumbnail);
+  if (!image.empty()) {
+    cv::resize(image, image, cv::Size(geometry.width(), geometry.height()));
+    cv::flip(image, image, 0);
   }
+  return image;
+}
 
-  void Write(const std::string& filename) const {
-    std::ofstream output(filename);
-    file::RecordWriter record_writer(&output);
-    for (const Thumbnail& thumbnail : thumbnails_) {
-      record_writer.Write<Thumbnail>(thumbnail);
+class Mosaic {
+ public:
+  // Tiles are matched in parallel on the given thread pool, and their
+  // thumbnails added to atlas for drawing.  original must be
+  // geometry.width() by geometry.height() pixels.  If cancelled is not null
+  // and becomes true, matching stops early and the mosaic is left
+  // incomplete, to be thrown away.
+  Mosaic(const cv::Mat& original,
+         const MosaicGeometry& geometry,
+         const ThumbnailLibrary* library,
+         util::ThreadPool* pool,
+         graphics::TileAtlas* atlas,
+         const std::atomic<bool>* cancelled = nullptr)
+      : geometry_(geometry),
+        library_(library),
+        atlas_(atlas),
+        quads_(atlas) {
+    Build(original, pool, cancelled);
+    if (cancelled != nullptr && *cancelled) {
+      return;
     }
-    record_writer.Close();
-  }
-  
-  void Read(const std::string& filename) {
-    std::ifstream input(filename);
-    file::RecordReader record_reader(&input);
-    thumbnails_.clear();
-    thumbnails_.push_back(Thumbnail());
-    while (record_reader.Read<Thumbnail>(&thumbnails_.back())) {
-      thumbnails_.push_back(Thumbnail());
+    for (int r = 0; r < geometry_.grid_size; ++r) {
+      for (int c = 0; c < geometry_.grid_size; ++c) {
+        int index = tile(r, c);
+        if (index >= 0) {
+          quads_.Add(library_->pixels(index), geometry_.tile_width * c,
+                     geometry_.tile_height * r, geometry_.tile_width,
+                     geometry_.tile_height);
+        }
+      }
     }
-    thumbnails_.pop_back();
-    record_reader.Close();
+  }
+
+  const MosaicGeometry& geometry() const { return geometry_; }
+
+  // Index of the thumbnail for the tile in row r and column c, counting
+  // from the bottom left, or -1 if there is none.
+  int tile(int r, int c) const {
+    return mosaic_[r * geometry_.grid_size + c];
+  }
 
-    std::cout << "Loaded " << thumbnails_.size() << " thumbnails." << std::endl;
+  // Draw the mosaic from (0, 0) to (geometry().width(), geometry().height()).
+  // The thumbnails are uploaded on the first call, after which every call is
+  // a single draw call.
+  void Draw() {
+    atlas_->Draw(&quads_);
   }
 
-  const Thumbnail* FindClosest(const uint8_t* pixels) const {
-    const Thumbnail* best = nullptr;
-    int best_diff = std::numeric_limits<int>::max();
-    for (const Thumbnail& thumbnail : thumbnails_) {
-      int diff = 0;
-      for (int i = 0; i < 3 * 20 * 15; ++i) {
-        diff += (pixels[i] - thumbnail.pixels[i]) *
-            (pixels[i] - thumbnail.pixels[i]);
+ private:
+  void Build(const cv::Mat& original, util::ThreadPool* pool,
+             const std::atomic<bool>* cancelled) {
+    const image::TileSampler sampler(geometry_.tile_width,
+                                     geometry_.tile_height, Thumbnail::kWidth,
+                                     Thumbnail::kHeight);
+    const int grid_size = geometry_.grid_size;
+    const int tile_bytes = sizeof(Thumbnail::pixels);
+    // Every tile is matched independently, so the result does not depend on
+    // how tiles are spread over threads, and threads take whole batches.
+    mosaic_.resize(grid_size * grid_size);
+    const int kTileGrain = ThumbnailLibrary::kBatchTiles;
+    pool->ParallelFor(0, grid_size * grid_size, kTileGrain,
+                      [&](int begin, int end) {
+      if (cancelled != nullptr && *cancelled) {
+        return;
       }
-      if (diff < best_diff) {
-        best_diff = diff;
-        best = &thumbnail;
+      // Reduce the tiles to thumbnail size first, so they can all be matched
+      // in one batch.
+      std::vector<uint8_t> tiles((end - begin) * tile_bytes);
+      for (int i = begin; i < end; ++i) {
+        const int r = i / grid_size;
+        const int c = i % grid_size;
+        sampler.Sample(original.ptr<uint8_t>(r * geometry_.tile_height) +
+                           3 * c * geometry_.tile_width,
+                       original.step, &tiles[(i - begin) * tile_bytes]);
       }
-    }
-    return best;
+      library_->FindClosestBatch(tiles.data(), end - begin, &mosaic_[begin]);
+    });
   }
 
- private:
-  std::vector<Thumbnail> thumbnails_;
+  const MosaicGeometry geometry_;
+  const ThumbnailLibrary* library_;
+  graphics::TileAtlas* atlas_;
+  // Index of the thumbnail for each tile.
+  std::vector<int> mosaic_;
+  graphics::TileQuads quads_;
 };
 
-class Mosaic {
+// The mosaics of the photos in a library, built on a thread pool when first
+// asked for or ahead of time, and kept until they are the least recently
+// used of more than capacity.
+//
+// Prefetching is speculative, so it must not hold up mosaics asked for by
+// Get.  Prefetch builds, including the matching of their tiles, run on a
+// separate pool with half as many threads, so tasks of a Get build never
+// queue behind them, and prefetch builds that are no longer wanted are
+// cancelled.
+class MosaicCache {
  public:
-  Mosaic(const cv::Mat& original,
-         const ThumbnailLibrary* library) : library_(library) {
-    Build(original);
+  // How well prefetching predicted the mosaics asked for.
+  struct Stats {
+    // Mosaics that were built by the time they were first asked for, and
+    // those that were not.
+    int64_t hits;
+    int64_t misses;
+    // Prefetch builds finished, and cancelled.
+    int64_t prefetched;
+    int64_t cancelled;
+  };
+
+  // Mosaics are built with the given geometry.  built is called on a pool
+  // thread whenever a mosaic was built.
+  MosaicCache(const MosaicGeometry& geometry,
+              const ThumbnailLibrary* library, util::ThreadPool* pool,
+              graphics::TileAtlas* atlas, int capacity,
+              std::function<void()> built)
+      : geometry_(geometry),
+        library_(library),
+        pool_(pool),
+        atlas_(atlas),
+        capacity_(std::max(capacity, 1)),
+        prefetch_pool_(std::max(pool->num_threads() / 2, 1)),
+        max_prefetching_(prefetch_pool_.num_threads()),
+        built_(built),
+        building_(0),
+        prefetching_(0) {
+    stats_.hits = 0;
+    stats_.misses = 0;
+    stats_.prefetched = 0;
+    stats_.cancelled = 0;
+  }
+
+  // Cancels prefetching, and waits for the mosaics being built.
+  ~MosaicCache() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wanted_.clear();
+    for (auto& entry : entries_) {
+      if (entry.second.prefetch) {
+        *entry.second.cancelled = true;
+      }
+    }
+    idle_.wait(lock, [this] { return building_ == 0; });
+  }
+
+  // Returns the mosaic of the photo of the thumbnail with the given index if
+  // it is built.  Otherwise starts building it, unless as many are being
+  // built for Get as the pool has threads, and returns null.  Photos that
+  // can not be read never get a mosaic.
+  std::shared_ptr<Mosaic> Get(int index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(index);
+    if (it != entries_.end()) {
+      Entry& entry = it->second;
+      // A cancelled build is counted when it is started over.
+      if (!entry.requested && !*entry.cancelled) {
+        entry.requested = true;
+        ++(entry.building ? stats_.misses : stats_.hits);
+      }
+      if (entry.building) {
+        // Keep building it even if it is no longer prefetched.
+        entry.prefetch = false;
+      } else {
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+      }
+      return entry.mosaic;
+    }
+    if (building_ - prefetching_ >= pool_->num_threads()) {
+      return nullptr;
+    }
+    ++stats_.misses;
+    StartBuild(index, false);
+    return nullptr;
   }
 
-  void Draw() const {
-    glPixelZoom(0.5, 0.5);
-    for (int r = 0; r < 80; ++r) {
-      for (int c = 0; c < 80; ++c) {
-        glRasterPos2f(0.5 * 20 * c, 0.5 * 15 * r);
-        const Thumbnail* thumbnail = mosaic_[r * 80 + c];
-        glDrawPixels(20, 15, GL_BGR, GL_UNSIGNED_BYTE,
-                     thumbnail->pixels);
+  // Build the mosaics of the given thumbnails, most wanted first, while
+  // fewer are being prefetched than half the threads.  This replaces the
+  // previous list, and cancels prefetch builds not on the new one.
+  void Prefetch(const std::vector<int>& indices) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wanted_ = indices;
+    std::unordered_set<int> wanted(indices.begin(), indices.end());
+    for (auto& entry : entries_) {
+      if (entry.second.prefetch && wanted.count(entry.first) == 0) {
+        *entry.second.cancelled = true;
       }
     }
+    StartPrefetches();
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
   }
 
  private:
-  void Build(const cv::Mat& original) {
-    uint8_t pixels[3 * 20 * 15];
-    for (int r = 0; r < 80; ++r) {
-      for (int c = 0; c < 80; ++c) {
-        for (int y = 0; y < 15; ++y) {
-          for (int x = 0; x < 20; ++x) {
-            int orig_y = r * 15 + y;
-            int orig_x = c * 20 + x;
-            pixels[3 * (20 * y + x) + 0] =
-                original.data[3 * (1600 * orig_y + orig_x) + 0];
-            pixels[3 * (20 * y + x) + 1] =
-                original.data[3 * (1600 * orig_y + orig_x) + 1];
-            pixels[3 * (20 * y + x) + 2] =
-                original.data[3 * (1600 * orig_y + orig_x) + 2];
-          }
+  struct Entry {
+    // Null while building, or if the photo could not be read.
+    std::shared_ptr<Mosaic> mosaic;
+    bool building;
+    // True while built only for prefetching, and once asked for by Get.
+    bool prefetch;
+    bool requested;
+    // Set to stop a prefetch build.
+    std::shared_ptr<std::atomic<bool>> cancelled;
+    // Position in lru_ once built.
+    std::list<int>::iterator lru;
+  };
+
+  // Start building a mosaic, with the lock held.
+  void StartBuild(int index, bool prefetch) {
+    Entry& entry = entries_[index];
+    entry.building = true;
+    entry.prefetch = prefetch;
+    entry.requested = !prefetch;
+    entry.cancelled = std::make_shared<std::atomic<bool>>(false);
+    ++building_;
+    prefetching_ += prefetch;
+    std::shared_ptr<std::atomic<bool>> cancelled = entry.cancelled;
+    // A prefetch build stays on the prefetch pool even if Get asks for it
+    // meanwhile.
+    util::ThreadPool* pool = prefetch ? &prefetch_pool_ : pool_;
+    pool->Schedule([this, index, prefetch, cancelled] {
+      Build(index, prefetch, *cancelled);
+    });
+  }
+
+  // Start prefetch builds for the most wanted mosaics not built yet, with the
+  // lock held.
+  void StartPrefetches() {
+    for (int index : wanted_) {
+      if (prefetching_ >= max_prefetching_) {
+        return;
+      }
+      if (entries_.count(index) == 0) {
+        StartBuild(index, true);
+      }
+    }
+  }
+
+  void Build(int index, bool prefetch, const std::atomic<bool>& cancelled) {
+    std::shared_ptr<Mosaic> mosaic;
+    cv::Mat image;
+    if (!cancelled) {
+      image = LoadMosaicImage(library_->filename(index), geometry_);
+    }
+    if (!image.empty() && !cancelled) {
+      mosaic = std::make_shared<Mosaic>(
+          image, geometry_, library_, prefetch ? &prefetch_pool_ : pool_,
+          atlas_, &cancelled);
+    }
+    bool built = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Entry& entry = entries_[index];
+      if (cancelled) {
+        // Asked for again later, it starts over.
+        entries_.erase(index);
+        ++stats_.cancelled;
+      } else {
+        entry.mosaic = mosaic;
+        entry.building = false;
+        stats_.prefetched += entry.prefetch;
+        entry.prefetch = false;
+        lru_.push_front(index);
+        entry.lru = lru_.begin();
+        // Mosaics still shown stay alive through their shared_ptr.
+        while (static_cast<int>(lru_.size()) > capacity_) {
+          entries_.erase(lru_.back());
+          lru_.pop_back();
         }
-        mosaic_.push_back(library_->FindClosest(pixels));
+        built = true;
       }
+      prefetching_ -= prefetch;
+      StartPrefetches();
+    }
+    if (built) {
+      built_();
     }
+    // Notify while holding the lock, as the cache may be destroyed as soon
+    // as the last build is done.
+    std::lock_guard<std::mutex> lock(mutex_);
+    --building_;
+    idle_.notify_all();
   }
 
-  const ThumbnailLibrary* library_;
-  std::vector<const Thumbnail*> mosaic_;
+  const MosaicGeometry geometry_;
+  const ThumbnailLibrary* const library_;
+  util::ThreadPool* const pool_;
+  graphics::TileAtlas* const atlas_;
+  const int capacity_;
+  // Destroyed after the destructor waited for the builds on it.
+  util::ThreadPool prefetch_pool_;
+  // At most one prefetch build per thread of prefetch_pool_.
+  const int max_prefetching_;
+  const std::function<void()> built_;
+
+  mutable std::mutex mutex_;
+  // Signalled when a build is done.
+  std::condition_variable idle_;
+  std::unordered_map<int, Entry> entries_;
+  // Indices of the built entries, most recently used first.
+  std::list<int> lru_;
+  // The mosaics to prefetch, most wanted first.
+  std::vector<int> wanted_;
+  int building_;
+  // Builds started by Prefetch, counted until done even if asked for since.
+  int prefetching_;
+  Stats stats_;
 };
 
+// Shows a mosaic that can be zoomed into without end.  Once a tile is large
+// enough on screen, it is drawn as the mosaic of its own photo, and once that
+// fills the window the view moves into it, so coordinates stay in the range
+// of one mosaic however deep the zoom goes.
 class MosaicWindow : public graphics::Window2d {
  public:
-  MosaicWindow() : graphics::Window2d(800, 600, "Infinipic") {}
+  // Shows mosaics with the given geometry.
+  explicit MosaicWindow(const MosaicGeometry& geometry)
+      : graphics::Window2d(800, 600, "Infinipic"),
+        geometry_(geometry),
+        cache_(nullptr) {
+    ResetView();
+  }
   virtual ~MosaicWindow() {}
 
-  void SetMosaic(const Mosaic* mosaic) {
-    mosaic_ = mosaic;
+  // Show mosaic, zoomed out to fit the window, with the mosaics of its
+  // tiles from cache.
+  void SetMosaic(const std::shared_ptr<Mosaic>& mosaic, MosaicCache* cache) {
+    levels_.assign(1, Level());
+    levels_[0].mosaic = mosaic;
+    cache_ = cache;
+    ResetView();
+  }
+
+  // Drop the mosaics shown, so they can be destroyed before the atlas they
+  // are drawn from.  The window must not be drawn again until SetMosaic.
+  void ClearMosaic() {
+    levels_.clear();
+    cache_ = nullptr;
   }
   
  protected:
@@ -155,16 +498,266 @@ class MosaicWindow : public graphics::Window2d {
       case XK_Escape:
         Close();
         break;
+      case XK_Left:
+        Pan(-0.25 * width(), 0.0);
+        break;
+      case XK_Right:
+        Pan(0.25 * width(), 0.0);
+        break;
+      case XK_Up:
+        Pan(0.0, 0.25 * height());
+        break;
+      case XK_Down:
+        Pan(0.0, -0.25 * height());
+        break;
+      case XK_plus:
+      case XK_equal:
+      case XK_Page_Up:
+        Zoom(kZoomStep, 0.5 * width(), 0.5 * height());
+        break;
+      case XK_minus:
+      case XK_Page_Down:
+        Zoom(1.0 / kZoomStep, 0.5 * width(), 0.5 * height());
+        break;
+      case XK_Home:
+        ResetView();
+        break;
+    }
+  }
+
+  // The scroll wheel zooms around the pointer, and a click centers the view
+  // on the clicked point.
+  virtual void Buttonpress(unsigned int button, int x, int y) {
+    double window_y = height() - y;
+    switch (button) {
+      case Button1:
+        Pan(x - 0.5 * width(), window_y - 0.5 * height());
+        break;
+      case Button4:
+        Zoom(kZoomStep, x, window_y);
+        break;
+      case Button5:
+        Zoom(1.0 / kZoomStep, x, window_y);
+        break;
     }
   }
 
   virtual void Draw() {
+    UpdateLevel();
     glClear(GL_COLOR_BUFFER_BIT);
-    mosaic_->Draw();
+    glLoadIdentity();
+    glTranslated(0.5 * width(), 0.5 * height(), 0.0);
+    glScaled(scale_, scale_, 1.0);
+    glTranslated(-center_x_, -center_y_, 0.0);
+    Mosaic* mosaic = levels_.back().mosaic.get();
+    mosaic->Draw();
+    PrefetchTiles(*mosaic);
+
+    // Draw large tiles as their own mosaics where those are built, which
+    // starts building the others.
+    if (geometry_.tile_width * scale_ < kDetailTilePixels) {
+      return;
+    }
+    int first_row, last_row, first_column, last_column;
+    VisibleTiles(&first_row, &last_row, &first_column, &last_column);
+    for (int r = first_row; r <= last_row; ++r) {
+      for (int c = first_column; c <= last_column; ++c) {
+        int index = mosaic->tile(r, c);
+        std::shared_ptr<Mosaic> child =
+            index >= 0 ? cache_->Get(index) : nullptr;
+        if (child) {
+          glPushMatrix();
+          glTranslated(geometry_.tile_width * c, geometry_.tile_height * r,
+                       0.0);
+          glScaled(1.0 / geometry_.grid_size, 1.0 / geometry_.grid_size, 1.0);
+          child->Draw();
+          glPopMatrix();
+        }
+      }
+    }
   }
 
  private:
-  const Mosaic* mosaic_;
+  // A mosaic being shown, with the tile of the previous level it belongs
+  // to.
+  struct Level {
+    std::shared_ptr<Mosaic> mosaic;
+    int row;
+    int column;
+  };
+
+  // Tiles are drawn as mosaics once they are this many pixels wide, and
+  // their mosaics prefetched from a quarter of that.
+  static const int kDetailTilePixels = 100;
+  static const int kPrefetchTilePixels = kDetailTilePixels / 4;
+  // The number of tiles nearest to where the view is heading to prefetch.
+  static const int kPrefetchTiles = 16;
+  static constexpr double kZoomStep = 1.25;
+
+  // Show all of the outermost mosaic.
+  void ResetView() {
+    if (levels_.size() > 1) {
+      levels_.resize(1);
+    }
+    scale_ = FitScale();
+    center_x_ = 0.5 * geometry_.width();
+    center_y_ = 0.5 * geometry_.height();
+    heading_x_ = center_x_;
+    heading_y_ = center_y_;
+  }
+
+  // The scale at which a whole mosaic fits in the window.
+  double FitScale() const {
+    return std::min(static_cast<double>(width()) / geometry_.width(),
+                    static_cast<double>(height()) / geometry_.height());
+  }
+
+  // Move the view by the given number of pixels.
+  void Pan(double dx, double dy) {
+    center_x_ += dx / scale_;
+    center_y_ += dy / scale_;
+    // Expect another step in the same direction.
+    heading_x_ = center_x_ + dx / scale_;
+    heading_y_ = center_y_ + dy / scale_;
+  }
+
+  // Zoom by factor, keeping the point at pixel (x, y) in place.
+  void Zoom(double factor, double x, double y) {
+    double offset_x = x - 0.5 * width();
+    double offset_y = y - 0.5 * height();
+    double point_x = center_x_ + offset_x / scale_;
+    double point_y = center_y_ + offset_y / scale_;
+    // Without the mosaic of a tile, stop once it is a few times the size of
+    // the window.
+    double max_scale = 4.0 * width() / geometry_.tile_width;
+    scale_ = std::min(scale_ * factor, max_scale);
+    center_x_ = point_x - offset_x / scale_;
+    center_y_ = point_y - offset_y / scale_;
+    // Zooming in heads for the point zoomed at.
+    heading_x_ = factor > 1.0 ? point_x : center_x_;
+    heading_y_ = factor > 1.0 ? point_y : center_y_;
+  }
+
+  // Prefetch the mosaics of the tiles in and next to the window nearest to
+  // where the view is heading, once tiles are large enough that zooming in
+  // further will soon need them.  Prefetches no longer wanted are cancelled.
+  void PrefetchTiles(const Mosaic& mosaic) {
+    std::vector<int> wanted;
+    if (geometry_.tile_width * scale_ >= kPrefetchTilePixels) {
+      int first_row, last_row, first_column, last_column;
+      VisibleTiles(&first_row, &last_row, &first_column, &last_column);
+      std::vector<std::pair<double, int>> tiles;
+      for (int r = std::max(first_row - 1, 0);
+           r <= std::min(last_row + 1, geometry_.grid_size - 1); ++r) {
+        for (int c = std::max(first_column - 1, 0);
+             c <= std::min(last_column + 1, geometry_.grid_size - 1); ++c) {
+          int index = mosaic.tile(r, c);
+          if (index < 0) {
+            continue;
+          }
+          double dx = geometry_.tile_width * (c + 0.5) - heading_x_;
+          double dy = geometry_.tile_height * (r + 0.5) - heading_y_;
+          tiles.push_back(std::make_pair(dx * dx + dy * dy, index));
+        }
+      }
+      std::sort(tiles.begin(), tiles.end());
+      std::unordered_set<int> seen;
+      for (size_t i = 0; i < tiles.size() &&
+               static_cast<int>(wanted.size()) < kPrefetchTiles; ++i) {
+        if (seen.insert(tiles[i].second).second) {
+          wanted.push_back(tiles[i].second);
+        }
+      }
+    }
+    cache_->Prefetch(wanted);
+  }
+
+  // The range of tiles of the current level in the window.
+  void VisibleTiles(int* first_row, int* last_row, int* first_column,
+                    int* last_column) const {
+    double half_width = 0.5 * width() / scale_;
+    double half_height = 0.5 * height() / scale_;
+    const int last = geometry_.grid_size - 1;
+    auto clamp = [last](double value) {
+      return std::max(0, std::min(last, static_cast<int>(std::floor(value))));
+    };
+    *first_column = clamp((center_x_ - half_width) / geometry_.tile_width);
+    *last_column = clamp((center_x_ + half_width) / geometry_.tile_width);
+    *first_row = clamp((center_y_ - half_height) / geometry_.tile_height);
+    *last_row = clamp((center_y_ + half_height) / geometry_.tile_height);
+  }
+
+  // Move out to the previous level while the window shows more than the
+  // current mosaic, and into the mosaic of a tile once that is built and
+  // fills the window.  The outermost mosaic is kept at least as large as
+  // the window, and in view.
+  void UpdateLevel() {
+    while (true) {
+      double half_width = 0.5 * width() / scale_;
+      double half_height = 0.5 * height() / scale_;
+      bool inside = center_x_ - half_width >= 0.0 &&
+          center_x_ + half_width <= geometry_.width() &&
+          center_y_ - half_height >= 0.0 &&
+          center_y_ + half_height <= geometry_.height();
+      if (!inside && levels_.size() > 1) {
+        const Level& level = levels_.back();
+        center_x_ = geometry_.tile_width * level.column +
+            center_x_ / geometry_.grid_size;
+        center_y_ = geometry_.tile_height * level.row +
+            center_y_ / geometry_.grid_size;
+        scale_ *= geometry_.grid_size;
+        heading_x_ = center_x_;
+        heading_y_ = center_y_;
+        levels_.pop_back();
+        continue;
+      }
+      if (!inside) {
+        scale_ = std::max(scale_, FitScale());
+        center_x_ = std::max(0.0, std::min<double>(geometry_.width(),
+                                                   center_x_));
+        center_y_ = std::max(0.0, std::min<double>(geometry_.height(),
+                                                   center_y_));
+        return;
+      }
+
+      int first_row, last_row, first_column, last_column;
+      VisibleTiles(&first_row, &last_row, &first_column, &last_column);
+      if (first_row != last_row || first_column != last_column) {
+        return;
+      }
+      int index = levels_.back().mosaic->tile(first_row, first_column);
+      std::shared_ptr<Mosaic> child =
+          index >= 0 ? cache_->Get(index) : nullptr;
+      if (!child) {
+        return;
+      }
+      Level level;
+      level.mosaic = child;
+      level.row = first_row;
+      level.column = first_column;
+      levels_.push_back(level);
+      center_x_ = (center_x_ - geometry_.tile_width * first_column) *
+          geometry_.grid_size;
+      center_y_ = (center_y_ - geometry_.tile_height * first_row) *
+          geometry_.grid_size;
+      scale_ /= geometry_.grid_size;
+      heading_x_ = center_x_;
+      heading_y_ = center_y_;
+    }
+  }
+
+  const MosaicGeometry geometry_;
+  MosaicCache* cache_;
+  // The outermost mosaic first, and the one the view is in last.
+  std::vector<Level> levels_;
+  // The point of the current mosaic in the middle of the window, and the
+  // number of pixels per unit of it.
+  double center_x_;
+  double center_y_;
+  double scale_;
+  // Where the view is expected to go next, for prefetching.
+  double heading_x_;
+  double heading_y_;
 };
 
 std::set<std::string> Split(const std::string& str, const char delim) {
@@ -177,71 +770,474 @@ std::set<std::string> Split(const std::string& str, const char delim) {
   return result;
 }
 
-// Recursively gather all photo paths in the given directory, where a photo
-// is anything that ends in .jpg or .jpeg.
-void GatherPhotos(const path& dir_path,
-                  std::vector<std::string>* photos) {
-  static std::set<std::string> blacklist(Split(FLAGS_directory_blacklist, ','));
-  boost::filesystem::directory_iterator end_itr;
-  for (boost::filesystem::directory_iterator itr(dir_path);
-       itr != end_itr; ++itr) {
-    if (is_directory(itr->status()) &&
-        blacklist.count(itr->path().string()) == 0) {
-      GatherPhotos(itr->path(), photos);
-    } else {
-      const std::string& file_path = itr->path().string();
-      if (boost::algorithm::ends_with(file_path, ".jpg") ||
-          boost::algorithm::ends_with(file_path, ".jpeg")) {
-        photos->push_back(file_path);
-      }
+// A photo is anything that ends in .jpg or .jpeg.
+bool IsPhoto(const char* name) {
+  return boost::algorithm::ends_with(name, ".jpg") ||
+      boost::algorithm::ends_with(name, ".jpeg");
+}
+
+// Start finding all photos under --image_directory, skipping the
+// directories in --directory_blacklist.
+std::unique_ptr<file::DirectoryWalker> WalkPhotos(util::ThreadPool* pool) {
+  return std::unique_ptr<file::DirectoryWalker>(new file::DirectoryWalker(
+      pool, FLAGS_image_directory, IsPhoto,
+      Split(FLAGS_directory_blacklist, ',')));
+}
+
+// Load a photo and shrink it to thumbnail pixels, either decoding it at a
+// reduced size or at full resolution.  Returns false if the photo could not be
+// read or does not have a 4:3 aspect ratio.
+bool LoadThumbnailPixels(const std::string& photo, bool fast_decode,
+                         uint8_t* pixels) {
+  cv::Mat image;
+  int width, height;
+  if (!fast_decode ||
+      !image::ReadJpegReduced(photo, Thumbnail::kWidth, Thumbnail::kHeight,
+                              &image, &width, &height)) {
+    image = cv::imread(photo, CV_LOAD_IMAGE_COLOR);
+    width = image.cols;
+    height = image.rows;
+  }
+  if (image.empty() || width * 6 != height * 8) {
+    return false;
+  }
+  cv::resize(image, image, cv::Size(Thumbnail::kWidth, Thumbnail::kHeight));
+  cv::flip(image, image, 0);
+  memcpy(pixels, image.data, sizeof(Thumbnail::pixels));
+  return true;
+}
+
+// What a previous run of thumbnail generation found for a photo.
+struct PreviousPhoto {
+  int64_t file_size;
+  int64_t mtime;
+  // Null if the photo was skipped.
+  const uint8_t* pixels;
+};
+
+typedef std::unordered_map<std::string, PreviousPhoto> PreviousPhotos;
+
+// The outcome of generating a thumbnail for one photo.
+struct PhotoResult {
+  // False if the photo could not be read or is not 4:3.
+  bool usable;
+  // True if the previous run saw this photo, and if its result was reused.
+  bool known;
+  bool reused;
+  // The filename, file size and mtime are always set, the pixels only if
+  // usable.
+  Thumbnail thumbnail;
+};
+
+// Index the photos a previous run stored in library by filename.
+void ReadPreviousPhotos(const ThumbnailLibrary& library,
+                        PreviousPhotos* previous) {
+  for (int i = 0; i < library.size(); ++i) {
+    PreviousPhoto& photo = (*previous)[library.filename(i)];
+    photo.file_size = library.file_size(i);
+    photo.mtime = library.mtime(i);
+    photo.pixels = library.pixels(i);
+  }
+  for (const SkippedPhoto& skipped : library.skipped()) {
+    PreviousPhoto& photo = (*previous)[skipped.filename];
+    photo.file_size = skipped.file_size;
+    photo.mtime = skipped.mtime;
+    photo.pixels = nullptr;
+  }
+}
+
+// Make the thumbnail for a photo, reusing the previous result if the photo
+// has the same size and modification time as back then.
+std::unique_ptr<PhotoResult> MakeThumbnail(const std::string& photo,
+                                           const PreviousPhotos& previous) {
+  std::unique_ptr<PhotoResult> result(new PhotoResult());
+  Thumbnail& thumbnail = result->thumbnail;
+  thumbnail.filename = photo;
+  boost::system::error_code error;
+  thumbnail.file_size = boost::filesystem::file_size(photo, error);
+  thumbnail.mtime = boost::filesystem::last_write_time(photo, error);
+  if (error) {
+    thumbnail.file_size = 0;
+    thumbnail.mtime = 0;
+  }
+
+  auto it = previous.find(photo);
+  result->known = it != previous.end();
+  if (!error && it != previous.end() &&
+      it->second.file_size == thumbnail.file_size &&
+      it->second.mtime == thumbnail.mtime) {
+    result->reused = true;
+    result->usable = it->second.pixels != nullptr;
+    if (result->usable) {
+      memcpy(thumbnail.pixels, it->second.pixels,
+             sizeof(thumbnail.pixels));
     }
+    return result;
   }
+
+  result->reused = false;
+  result->usable = LoadThumbnailPixels(photo, FLAGS_fast_decode,
+                                       thumbnail.pixels);
+  return result;
 }
 
-void GenerateThumbnails(const std::string& output_path) {
+// Time making thumbnails of the first n photos with and without fast
+// decoding, on a single thread, and report how much the thumbnails differ.
+// The photos are read once before timing, so both decodes find them in the
+// page cache and only decoding is compared.
+void BenchmarkDecode(int n, util::ThreadPool* pool) {
   std::vector<std::string> photos;
-  GatherPhotos(path(FLAGS_image_directory), &photos);
+  {
+    std::unique_ptr<file::DirectoryWalker> walker = WalkPhotos(pool);
+    std::string photo;
+    while (static_cast<int>(photos.size()) < n && walker->Next(&photo)) {
+      photos.push_back(photo);
+    }
+  }
 
-  ThumbnailLibrary library;
-  boost::progress_display progress_bar(photos.size(), std::cout,
-                                       "Generating thumbnails...\n");
+  std::vector<char> buffer(1 << 20);
   for (const std::string& photo : photos) {
-    cv::Mat image = cv::imread(photo, CV_LOAD_IMAGE_COLOR);
-    if (image.cols * 6 == image.rows * 8) {
-      cv::resize(image, image, cv::Size(20, 15));
-      cv::flip(image, image, 0);
+    std::ifstream file(photo, std::ios::binary);
+    while (file.read(buffer.data(), buffer.size())) {
+    }
+  }
+
+  std::vector<uint8_t> pixels[2];
+  std::vector<bool> loaded[2];
+  double seconds[2];
+  for (int fast = 0; fast < 2; ++fast) {
+    pixels[fast].resize(photos.size() * sizeof(Thumbnail::pixels));
+    loaded[fast].resize(photos.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < photos.size(); ++i) {
+      loaded[fast][i] = LoadThumbnailPixels(
+          photos[i], fast, &pixels[fast][i * sizeof(Thumbnail::pixels)]);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    seconds[fast] = elapsed.count();
+  }
+
+  int compared = 0;
+  uint64_t absolute_diff = 0;
+  uint64_t squared_diff = 0;
+  for (size_t i = 0; i < photos.size(); ++i) {
+    if (!loaded[0][i] || !loaded[1][i]) {
+      continue;
+    }
+    ++compared;
+    const uint8_t* full = &pixels[0][i * sizeof(Thumbnail::pixels)];
+    const uint8_t* reduced = &pixels[1][i * sizeof(Thumbnail::pixels)];
+    for (size_t j = 0; j < sizeof(Thumbnail::pixels); ++j) {
+      int diff = full[j] - reduced[j];
+      absolute_diff += std::abs(diff);
+      squared_diff += diff * diff;
+    }
+  }
+
+  std::cout << "Full resolution decode: " << photos.size() / seconds[0]
+            << " photos/s" << std::endl;
+  std::cout << "Reduced size decode: " << photos.size() / seconds[1]
+            << " photos/s (" << seconds[0] / seconds[1] << "x)" << std::endl;
+  if (compared > 0) {
+    double values = compared * sizeof(Thumbnail::pixels);
+    double mse = squared_diff / values;
+    std::cout << "Over " << compared << " thumbnails, mean absolute "
+              << "difference " << absolute_diff / values << ", PSNR "
+              << 10.0 * std::log10(255.0 * 255.0 / std::max(mse, 1e-10))
+              << " dB" << std::endl;
+  }
+}
+
+// Write the photos of two partial libraries to filename, taking those of
+// newer for photos in both, and set *thumbnails to the number of thumbnails
+// written.  Returns false if it could not be written.
+bool MergePartialLibraries(const ThumbnailLibrary& older,
+                           const ThumbnailLibrary& newer,
+                           const std::string& filename, int* thumbnails) {
+  std::unordered_set<std::string> in_newer;
+  for (int i = 0; i < newer.size(); ++i) {
+    in_newer.insert(newer.filename(i));
+  }
+  for (const SkippedPhoto& skipped : newer.skipped()) {
+    in_newer.insert(skipped.filename);
+  }
+
+  std::ofstream output(filename);
+  file::RecordWriter record_writer(
+      &output, file::RecordWriter::kDefaultBlockSize,
+      FLAGS_compress_thumbnails ? file::Compression::kZstd
+                                : file::Compression::kNone);
+  bool ok = true;
+  *thumbnails = 0;
+  for (const ThumbnailLibrary* library : {&older, &newer}) {
+    for (int i = 0; i < library->size(); ++i) {
+      if (library == &older && in_newer.count(library->filename(i)) > 0) {
+        continue;
+      }
       Thumbnail thumbnail;
-      strncpy(thumbnail.filename, photo.c_str(), 255);
-      memcpy(thumbnail.pixels, image.data, 3 * 20 * 15);
-      thumbnail.filename[255] = 0;
-      library.Add(thumbnail);
+      thumbnail.filename = library->filename(i);
+      memcpy(thumbnail.pixels, library->pixels(i), sizeof(thumbnail.pixels));
+      thumbnail.file_size = library->file_size(i);
+      thumbnail.mtime = library->mtime(i);
+      ok &= ThumbnailLibrary::WriteThumbnail(&record_writer, thumbnail);
+      ++*thumbnails;
+    }
+    for (const SkippedPhoto& skipped : library->skipped()) {
+      if (library == &older && in_newer.count(skipped.filename) > 0) {
+        continue;
+      }
+      ok &= ThumbnailLibrary::WriteSkipped(&record_writer, skipped);
     }
-    ++progress_bar;
   }
-  
-  library.Write(output_path);
+  return record_writer.Close() && ok;
+}
+
+// Photos are decoded and shrunk in parallel on the pool, while a single
+// writer appends the thumbnails to the output in directory walk order.  With
+// --incremental_thumbnails, photos that did not change since the output was
+// last written are not decoded again.
+//
+// Thumbnails are streamed to a temporary file, which is flushed every
+// --checkpoint_seconds.  If a run is interrupted, the next one reuses the
+// thumbnails in the temporary file in the same way as those of the previous
+// output, unless --incremental_thumbnails is off.
+void GenerateThumbnails(const std::string& output_path,
+                        util::ThreadPool* pool) {
+  // Photos are found while the previous libraries are read.
+  std::unique_ptr<file::DirectoryWalker> walker = WalkPhotos(pool);
+
+  ThumbnailLibrary previous_library;
+  PreviousPhotos previous;
+  if (FLAGS_incremental_thumbnails && boost::filesystem::exists(output_path)) {
+    previous_library.Read(output_path, pool);
+    ReadPreviousPhotos(previous_library, &previous);
+  }
+
+  // Write to a temporary file, so the previous library stays intact until
+  // the new one is complete.  The output of an interrupted run is moved out
+  // of the way first, as a partial library.  When a run resuming from it was
+  // interrupted too, the two are merged, as each may hold thumbnails the
+  // other lacks.
+  const std::string temp_path = output_path + ".tmp";
+  const std::string partial_path = output_path + ".partial";
+  boost::system::error_code error;
+  if (!FLAGS_incremental_thumbnails) {
+    boost::filesystem::remove(temp_path, error);
+    boost::filesystem::remove(partial_path, error);
+  }
+  ThumbnailLibrary partial_library;
+  ThumbnailLibrary interrupted_library;
+  // The number of thumbnails of interrupted runs.
+  int resumed = 0;
+  if (boost::filesystem::exists(partial_path)) {
+    partial_library.Read(partial_path, pool);
+    ReadPreviousPhotos(partial_library, &previous);
+    resumed = partial_library.size();
+  }
+  if (boost::filesystem::exists(temp_path)) {
+    interrupted_library.Read(temp_path, pool);
+    ReadPreviousPhotos(interrupted_library, &previous);
+    if (!boost::filesystem::exists(partial_path)) {
+      boost::filesystem::rename(temp_path, partial_path);
+      resumed = interrupted_library.size();
+    } else if (MergePartialLibraries(partial_library, interrupted_library,
+                                     temp_path + ".merge", &resumed)) {
+      boost::filesystem::rename(temp_path + ".merge", partial_path);
+    } else {
+      std::cerr << "Failed to merge " << temp_path << " into "
+                << partial_path << std::endl;
+      boost::filesystem::remove(temp_path + ".merge", error);
+      return;
+    }
+  }
+  if (resumed > 0) {
+    std::cout << "Resuming from " << resumed
+              << " thumbnails of interrupted runs." << std::endl;
+  }
+
+  std::ofstream output(temp_path);
+  file::RecordWriter record_writer(
+      &output, file::RecordWriter::kDefaultBlockSize,
+      FLAGS_compress_thumbnails ? file::Compression::kZstd
+                                : file::Compression::kNone);
+  // Keep compression and disk writes off the thread that hands out decoded
+  // thumbnails.
+  record_writer.WriteInBackground(file::RecordWriter::kDefaultQueuedBlocks);
+  auto last_checkpoint = std::chrono::steady_clock::now();
+  bool write_failed = false;
+  int known = 0;
+  int reused = 0;
+  int generated = 0;
+  int skipped = 0;
+  // The number of photos is only known once the walk is done, so progress is
+  // shown as a count rather than a bar.
+  auto last_progress = std::chrono::steady_clock::now();
+  std::cout << "Generating thumbnails..." << std::endl;
+  {
+    util::OrderedPipeline<std::string, std::unique_ptr<PhotoResult>> pipeline(
+        pool, 4 * pool->num_threads(),
+        [&previous](const std::string& photo) {
+          return MakeThumbnail(photo, previous);
+        },
+        [&](std::unique_ptr<PhotoResult>& result) {
+          const Thumbnail& thumbnail = result->thumbnail;
+          bool written;
+          if (result->usable) {
+            written = ThumbnailLibrary::WriteThumbnail(&record_writer,
+                                                       thumbnail);
+          } else {
+            SkippedPhoto skipped_photo;
+            skipped_photo.filename = thumbnail.filename;
+            skipped_photo.file_size = thumbnail.file_size;
+            skipped_photo.mtime = thumbnail.mtime;
+            written = ThumbnailLibrary::WriteSkipped(&record_writer,
+                                                     skipped_photo);
+            ++skipped;
+          }
+          known += result->known;
+          ++(result->reused ? reused : generated);
+
+          auto now = std::chrono::steady_clock::now();
+          if (now - last_progress >= std::chrono::seconds(1)) {
+            std::cout << "\r" << reused + generated << " of "
+                      << walker->found() << (walker->done() ? "" : "+")
+                      << " photos" << std::flush;
+            last_progress = now;
+          }
+          if (written && now - last_checkpoint >=
+                             std::chrono::seconds(FLAGS_checkpoint_seconds)) {
+            written = record_writer.Flush();
+            last_checkpoint = now;
+          }
+          write_failed |= !written;
+        });
+    std::string photo;
+    while (walker->Next(&photo)) {
+      pipeline.Push(std::move(photo));
+    }
+    pipeline.Finish();
+  }
+  std::cout << "\r" << reused + generated << " of " << walker->found()
+            << " photos" << std::endl;
+
+  // Product quantization codes need every thumbnail, so they are trained on
+  // the thumbnails read back from the temporary file rather than kept in
+  // memory while generating.
+  if (FLAGS_pq_subspaces > 0 && !write_failed && record_writer.Flush()) {
+    ThumbnailLibrary library;
+    library.Read(temp_path, pool);
+    library.TrainPq(FLAGS_pq_subspaces);
+    library.WritePq(&record_writer);
+  }
+  if (!record_writer.Close() || write_failed) {
+    std::cerr << "Failed to write " << temp_path << ", keeping "
+              << output_path << std::endl;
+    return;
+  }
+  boost::filesystem::rename(temp_path, output_path);
+  boost::filesystem::remove(partial_path, error);
+
+  std::cout << "Looked at " << walker->found() << " photos: reused " << reused
+            << ", decoded " << generated << ", skipped " << skipped
+            << ".  Dropped " << previous.size() - known
+            << " photos that no longer exist." << std::endl;
 }
 
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_verify_ssd_kernels) {
+    bool ok = match::VerifySsdKernels();
+    std::cout << "SSD kernels " << (ok ? "match" : "DO NOT match")
+              << " the scalar reference." << std::endl;
+    return ok ? 0 : 1;
+  }
+  if (FLAGS_verify_tile_samplers) {
+    bool ok = image::VerifyTileSamplers(Thumbnail::kWidth, Thumbnail::kHeight);
+    std::cout << "Tile samplers " << (ok ? "match" : "DO NOT match")
+              << " the generic kernel." << std::endl;
+    return ok ? 0 : 1;
+  }
+  if (!match::SelectSsdFunction(FLAGS_ssd_kernel)) {
+    std::cerr << "Unsupported --ssd_kernel: " << FLAGS_ssd_kernel << std::endl;
+    return 1;
+  }
   
+  util::ThreadPool pool(FLAGS_threads);
+
+  if (FLAGS_benchmark_decode > 0) {
+    BenchmarkDecode(FLAGS_benchmark_decode, &pool);
+    return 0;
+  }
+
   if (FLAGS_generate_thumbnails) {
-    GenerateThumbnails(FLAGS_thumbnail_file);
+    GenerateThumbnails(FLAGS_thumbnail_file, &pool);
   }
 
   ThumbnailLibrary library;
-  library.Read(FLAGS_thumbnail_file);
+  if (FLAGS_mapped_library) {
+    library.ReadMapped(FLAGS_thumbnail_file, &pool);
+  } else {
+    library.Read(FLAGS_thumbnail_file, &pool);
+  }
+
+  MatchMode match_mode;
+  if (!ParseMatchMode(FLAGS_match_mode, &match_mode)) {
+    std::cerr << "Unknown --match_mode: " << FLAGS_match_mode << std::endl;
+    return 1;
+  }
+  library.SetMeanColorOrder(FLAGS_match_mean_color_order);
+  library.SetPcaOptions(FLAGS_pca_dims, FLAGS_pca_candidates);
+  library.SetPqOptions(FLAGS_pq_subspaces > 0 ? FLAGS_pq_subspaces : 16,
+                       FLAGS_pq_candidates);
+  library.SetMeasureRecall(FLAGS_measure_recall);
+  library.SetMatchMode(match_mode);
 
   if (!FLAGS_single_image.empty()) {
-    cv::Mat image = cv::imread(FLAGS_single_image, CV_LOAD_IMAGE_COLOR);
-    cv::resize(image, image, cv::Size(1600,1200));
-    cv::flip(image, image, 0);
+    MosaicGeometry geometry;
+    geometry.grid_size = FLAGS_mosaic_grid_size;
+    geometry.tile_width = FLAGS_mosaic_tile_width;
+    geometry.tile_height = FLAGS_mosaic_tile_height;
+    if (geometry.grid_size < 1 || geometry.tile_width < 1 ||
+        geometry.tile_height < 1) {
+      std::cerr << "The mosaic grid and tile sizes must be positive."
+                << std::endl;
+      return 1;
+    }
+    cv::Mat image = LoadMosaicImage(FLAGS_single_image, geometry);
+    if (image.empty()) {
+      std::cerr << "Failed to read " << FLAGS_single_image << std::endl;
+      return 1;
+    }
 
-    Mosaic mosaic(image, &library);
-  
-    MosaicWindow window;
-    window.SetMosaic(&mosaic);
+    // Destroyed in reverse order, so the atlas goes while the window's
+    // OpenGL context is still around, after the mosaics using it, and the
+    // cache waits for its builds before the window they invalidate goes.
+    MosaicWindow window(geometry);
+    graphics::TileAtlas atlas(Thumbnail::kWidth, Thumbnail::kHeight);
+    std::shared_ptr<Mosaic> mosaic =
+        std::make_shared<Mosaic>(image, geometry, &library, &pool, &atlas);
+    std::cout << "Compared an average of " << library.AverageBytesExamined()
+              << " bytes per tile with the " << match::SsdFunctionName()
+              << " SSD kernel." << std::endl;
+    if (library.Recall() >= 0.0) {
+      std::cout << "Recall against an exhaustive scan: " << library.Recall()
+                << std::endl;
+    }
+
+    MosaicCache cache(geometry, &library, &pool, &atlas,
+                      FLAGS_mosaic_cache_size,
+                      [&window] { window.Invalidate(); });
+    window.SetMosaic(mosaic, &cache);
     window.Run();
+    window.ClearMosaic();
+
+    MosaicCache::Stats stats = cache.stats();
+    std::cout << "Prefetched " << stats.prefetched << " mosaics, cancelled "
+              << stats.cancelled << ".  Zoomed into " << stats.hits
+              << " prefetched and " << stats.misses << " other mosaics."
+              << std::endl;
   }
   
   return 0;
@@ -0,0 +1,87 @@
+#include "jpeg_decode.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <utility>
+
+#include <jpeglib.h>
+
+namespace image {
+namespace {
+
+// libjpeg's default error handler exits the process, instead jump back to
+// ReadJpegReduced and fail.
+struct ErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+void ErrorExit(j_common_ptr cinfo) {
+  longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+}
+
+void OutputMessage(j_common_ptr cinfo) {
+  // Warnings about corrupt data are expected in large photo archives.
+}
+
+}  // namespace
+
+bool ReadJpegReduced(const std::string& filename, int min_width,
+                     int min_height, cv::Mat* image, int* width,
+                     int* height) {
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  jpeg_decompress_struct cinfo;
+  ErrorManager error;
+  cinfo.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = ErrorExit;
+  error.pub.output_message = OutputMessage;
+  if (setjmp(error.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, file);
+  jpeg_read_header(&cinfo, TRUE);
+  *width = cinfo.image_width;
+  *height = cinfo.image_height;
+
+  // Scaled sizes are rounded up, so this always leaves enough pixels.
+  int denom = 8;
+  while (denom > 1 &&
+         (static_cast<int>(cinfo.image_width) < min_width * denom ||
+          static_cast<int>(cinfo.image_height) < min_height * denom)) {
+    denom /= 2;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+  if (cinfo.output_components != 3) {
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    return false;
+  }
+
+  image->create(cinfo.output_height, cinfo.output_width, CV_8UC3);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = image->ptr<JSAMPLE>(cinfo.output_scanline);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    // libjpeg decodes to RGB, OpenCV images are BGR.
+    for (unsigned int x = 0; x < cinfo.output_width; ++x) {
+      std::swap(row[3 * x], row[3 * x + 2]);
+    }
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(file);
+  return true;
+}
+
+}  // namespace image
@@ -0,0 +1,28 @@
+// Fast decoding of JPEGs that are only needed at a small size.
+//
+// libjpeg can scale images by 1/2, 1/4 or 1/8 while decoding, by using only
+// the low frequency DCT coefficients of each block.  This skips most of the
+// inverse DCT and color conversion work, and gives a decent box-filtered
+// image rather than one that has to be shrunk from full resolution.
+
+#ifndef INFINIPIC_JPEG_DECODE_H_
+#define INFINIPIC_JPEG_DECODE_H_
+
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+namespace image {
+
+// Decode the JPEG at filename into a BGR image of at least min_width by
+// min_height pixels, using the largest DCT scaling that allows it.  The size
+// of the full resolution image is stored in *width and *height.  Returns
+// false if the file can not be decoded this way, for example if it is not a
+// JPEG or uses an unsupported color space.
+bool ReadJpegReduced(const std::string& filename, int min_width,
+                     int min_height, cv::Mat* image, int* width,
+                     int* height);
+
+}  // namespace image
+
+#endif  // INFINIPIC_JPEG_DECODE_H_
@@ -0,0 +1,35 @@
+// Read-only memory mapping of a whole file.
+//
+// Pages are loaded on demand and live in the page cache, so mapping even a
+// large file takes constant time, and processes mapping the same file share
+// the memory.
+
+#ifndef INFINIPIC_MAPPED_FILE_H_
+#define INFINIPIC_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace file {
+
+class MappedFile {
+ public:
+  // Map the file, returning null if it can not be opened or is empty.
+  static std::unique_ptr<MappedFile> Open(const std::string& filename);
+
+  ~MappedFile();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const char* data, size_t size);
+
+  const char* const data_;
+  const size_t size_;
+};
+
+}  // namespace file
+
+#endif  // INFINIPIC_MAPPED_FILE_H_
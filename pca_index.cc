@@ -0,0 +1,174 @@
+#include "pca_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <queue>
+#include <utility>
+
+#include <opencv2/core/core.hpp>
+
+#include "recordio.h"
+#include "ssd.h"
+
+namespace match {
+namespace {
+
+// Computing the covariance is quadratic in input_dims and linear in the
+// number of samples, so train on an evenly spaced subset of large libraries.
+const int kMaxTrainingSamples = 20000;
+
+template <typename T>
+bool ReadVector(file::RecordReader* reader, size_t size,
+                std::vector<T>* data) {
+  file::RecordView record;
+  if (!reader->ReadRecord(&record) || record.size != size * sizeof(T)) {
+    return false;
+  }
+  data->resize(size);
+  memcpy(data->data(), record.data, record.size);
+  return true;
+}
+
+template <typename T>
+bool WriteVector(file::RecordWriter* writer, const std::vector<T>& data) {
+  return writer->WriteRecord(reinterpret_cast<const char*>(data.data()),
+                             data.size() * sizeof(T));
+}
+
+}  // namespace
+
+PcaIndex::PcaIndex(const uint8_t* base, size_t stride, int count,
+                   int input_dims)
+    : base_(base),
+      stride_(stride),
+      count_(count),
+      input_dims_(input_dims),
+      requested_dims_(0),
+      dims_(0) {
+}
+
+void PcaIndex::Train(int dims) {
+  requested_dims_ = dims;
+  dims_ = std::min(dims, input_dims_);
+  int samples = std::min(count_, kMaxTrainingSamples);
+  cv::Mat data(samples, input_dims_, CV_32F);
+  for (int r = 0; r < samples; ++r) {
+    const uint8_t* pixels = point(static_cast<int64_t>(r) * count_ / samples);
+    float* row = data.ptr<float>(r);
+    for (int j = 0; j < input_dims_; ++j) {
+      row[j] = pixels[j];
+    }
+  }
+  cv::PCA pca(data, cv::Mat(), cv::PCA::DATA_AS_ROW, dims_);
+  dims_ = pca.eigenvectors.rows;
+
+  mean_.assign(pca.mean.ptr<float>(0), pca.mean.ptr<float>(0) + input_dims_);
+  components_.resize(dims_ * input_dims_);
+  for (int d = 0; d < dims_; ++d) {
+    const float* row = pca.eigenvectors.ptr<float>(d);
+    std::copy(row, row + input_dims_, &components_[d * input_dims_]);
+  }
+
+  projected_.resize(static_cast<size_t>(count_) * dims_);
+  for (int i = 0; i < count_; ++i) {
+    Project(point(i), &projected_[static_cast<size_t>(i) * dims_]);
+  }
+}
+
+bool PcaIndex::Write(const std::string& filename,
+                     uint64_t source_size) const {
+  std::ofstream output(filename);
+  file::RecordWriter record_writer(&output,
+                                  file::RecordWriter::kDefaultBlockSize);
+  Header header = {count_, input_dims_, requested_dims_, dims_, source_size};
+  bool ok = record_writer.Write<Header>(header) &&
+      WriteVector(&record_writer, mean_) &&
+      WriteVector(&record_writer, components_) &&
+      WriteVector(&record_writer, projected_);
+  record_writer.Close();
+  return ok;
+}
+
+bool PcaIndex::Read(const std::string& filename, int dims,
+                    uint64_t source_size) {
+  std::ifstream input(filename);
+  if (!input) {
+    return false;
+  }
+  file::RecordReader record_reader(&input);
+  Header header;
+  bool ok = record_reader.Read<Header>(&header) &&
+      header.count == count_ && header.input_dims == input_dims_ &&
+      header.source_size == source_size &&
+      header.requested_dims == dims &&
+      header.dims > 0 && header.dims <= std::min(dims, input_dims_) &&
+      ReadVector(&record_reader, input_dims_, &mean_) &&
+      ReadVector(&record_reader, header.dims * input_dims_, &components_) &&
+      ReadVector(&record_reader, static_cast<size_t>(count_) * header.dims,
+                 &projected_);
+  record_reader.Close();
+  requested_dims_ = ok ? dims : 0;
+  dims_ = ok ? header.dims : 0;
+  return ok;
+}
+
+int PcaIndex::FindClosest(const uint8_t* query, int candidates,
+                          uint64_t* examined) const {
+  std::vector<float> projected_query(dims_);
+  Project(query, projected_query.data());
+
+  // Keep the closest candidates in the projected space in a max-heap.
+  candidates = std::max(candidates, 1);
+  std::priority_queue<std::pair<float, int>> closest;
+  const float* row = projected_.data();
+  for (int i = 0; i < count_; ++i, row += dims_) {
+    float distance = 0.0f;
+    for (int d = 0; d < dims_; ++d) {
+      float delta = projected_query[d] - row[d];
+      distance += delta * delta;
+    }
+    if (static_cast<int>(closest.size()) < candidates) {
+      closest.push(std::make_pair(distance, i));
+    } else if (distance < closest.top().first) {
+      closest.pop();
+      closest.push(std::make_pair(distance, i));
+    }
+  }
+
+  int best = -1;
+  int best_diff = std::numeric_limits<int>::max();
+  for (; !closest.empty(); closest.pop()) {
+    int i = closest.top().second;
+    int diff = Ssd(query, point(i), input_dims_);
+    *examined += input_dims_;
+    if (diff < best_diff || (diff == best_diff && i < best)) {
+      best_diff = diff;
+      best = i;
+    }
+  }
+  return best;
+}
+
+size_t PcaIndex::MemoryUsage() const {
+  return (mean_.capacity() + components_.capacity() + projected_.capacity()) *
+      sizeof(float);
+}
+
+void PcaIndex::Project(const uint8_t* pixels, float* projected) const {
+  std::vector<float> centered(input_dims_);
+  for (int j = 0; j < input_dims_; ++j) {
+    centered[j] = pixels[j] - mean_[j];
+  }
+  for (int d = 0; d < dims_; ++d) {
+    const float* component = &components_[d * input_dims_];
+    float sum = 0.0f;
+    for (int j = 0; j < input_dims_; ++j) {
+      sum += component[j] * centered[j];
+    }
+    projected[d] = sum;
+  }
+}
+
+}  // namespace match
@@ -0,0 +1,85 @@
+// An approximate nearest neighbour index that filters candidates in a
+// low-dimensional PCA projection of the points, and then re-ranks the best
+// few by their exact SSD (see ssd.h).
+//
+// Scanning dims floats per point instead of every byte makes the filter much
+// cheaper than a full scan.  The closer the reduced space is to the real
+// distances and the more candidates are re-ranked, the more often the result
+// agrees with an exhaustive scan.
+
+#ifndef INFINIPIC_PCA_INDEX_H_
+#define INFINIPIC_PCA_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace match {
+
+class PcaIndex {
+ public:
+  // Index count points of input_dims bytes each, where point i starts at
+  // base + i * stride.  The points are not copied and must outlive the index.
+  // The index is not usable until Train() or Read() succeeds.
+  PcaIndex(const uint8_t* base, size_t stride, int count, int input_dims);
+
+  // Compute the first dims principal components from a sample of the points,
+  // and project every point onto them.  There may be fewer than dims if there
+  // are too few points, or points of fewer dimensions.
+  void Train(int dims);
+
+  // Save the projection and projected points to a file, or load them from
+  // one written for the same points.  source_size identifies the points, for
+  // example by the size of the file they came from.  Read fails if the file
+  // does not match the number of points or source_size, or was trained for a
+  // different dims, even if that gave as many components as dims would.
+  bool Write(const std::string& filename, uint64_t source_size) const;
+  bool Read(const std::string& filename, int dims, uint64_t source_size);
+
+  // Return the index of the point with the smallest SSD to query among the
+  // candidates closest to it in the projected space, ties going to the lowest
+  // index, or -1 if there are no points.  The number of pixel bytes compared
+  // is added to *examined.
+  int FindClosest(const uint8_t* query, int candidates,
+                  uint64_t* examined) const;
+
+  int dims() const { return dims_; }
+
+  // Bytes of memory used by the projection and projected points.
+  size_t MemoryUsage() const;
+
+ private:
+  // Header record at the start of an index file.
+  struct Header {
+    int32_t count;
+    int32_t input_dims;
+    // The dims passed to Train, and the number of components it found.
+    int32_t requested_dims;
+    int32_t dims;
+    uint64_t source_size;
+  };
+
+  const uint8_t* point(int i) const { return base_ + i * stride_; }
+
+  void Project(const uint8_t* pixels, float* projected) const;
+
+  const uint8_t* base_;
+  size_t stride_;
+  int count_;
+  int input_dims_;
+  int requested_dims_;
+  int dims_;
+
+  // The mean point, and the principal components as rows of a dims_ by
+  // input_dims_ matrix.
+  std::vector<float> mean_;
+  std::vector<float> components_;
+
+  // Row i is point i projected onto the components.
+  std::vector<float> projected_;
+};
+
+}  // namespace match
+
+#endif  // INFINIPIC_PCA_INDEX_H_
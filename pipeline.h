@@ -0,0 +1,165 @@
+// A bounded pipeline that processes inputs in parallel on a ThreadPool, and
+// hands the outputs to a single consumer thread in the order the inputs
+// were pushed.
+//
+// At most capacity inputs are in flight at once, counting those waiting for
+// a worker, being processed, or waiting for earlier inputs to be consumed.
+// Push blocks once the pipeline is full, so a slow consumer throttles the
+// producer instead of letting outputs pile up in memory.
+//
+// Example:
+//   util::OrderedPipeline<std::string, Image> pipeline(
+//       &pool, 64, Decode, [&writer](Image& image) { writer.Write(image); });
+//   for (const std::string& path : paths) pipeline.Push(path);
+//   pipeline.Finish();
+
+#ifndef INFINIPIC_PIPELINE_H_
+#define INFINIPIC_PIPELINE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "thread_pool.h"
+
+namespace util {
+
+template <typename In, typename Out>
+class OrderedPipeline {
+ public:
+  OrderedPipeline(ThreadPool* pool, int capacity,
+                  std::function<Out(const In&)> process,
+                  std::function<void(Out&)> consume);
+
+  // Calls Finish() if it has not been called yet.
+  ~OrderedPipeline();
+
+  // Queue an input for processing, blocking while the pipeline is full.
+  void Push(In in);
+
+  // Wait until every pushed input has been processed and consumed.  No more
+  // inputs may be pushed afterwards.
+  void Finish();
+
+ private:
+  struct Slot {
+    In in;
+    Out out;
+    bool done;
+  };
+
+  void Process(uint64_t sequence);
+  void ConsumerLoop();
+
+  ThreadPool* const pool_;
+  const size_t capacity_;
+  const std::function<Out(const In&)> process_;
+  const std::function<void(Out&)> consume_;
+
+  std::mutex mutex_;
+  // Signalled when the front slot is done, or when finishing.
+  std::condition_variable front_done_;
+  // Signalled when a slot is consumed and freed.
+  std::condition_variable slot_free_;
+  // In flight inputs, in push order, starting at sequence number first_.
+  std::deque<Slot> slots_;
+  uint64_t first_;
+  bool finishing_;
+  std::thread consumer_;
+};
+
+template <typename In, typename Out>
+OrderedPipeline<In, Out>::OrderedPipeline(
+    ThreadPool* pool, int capacity, std::function<Out(const In&)> process,
+    std::function<void(Out&)> consume)
+    : pool_(pool),
+      capacity_(capacity > 0 ? capacity : 1),
+      process_(process),
+      consume_(consume),
+      first_(0),
+      finishing_(false),
+      consumer_(&OrderedPipeline::ConsumerLoop, this) {
+}
+
+template <typename In, typename Out>
+OrderedPipeline<In, Out>::~OrderedPipeline() {
+  Finish();
+}
+
+template <typename In, typename Out>
+void OrderedPipeline<In, Out>::Push(In in) {
+  uint64_t sequence;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    slot_free_.wait(lock, [this] { return slots_.size() < capacity_; });
+    sequence = first_ + slots_.size();
+    slots_.push_back(Slot());
+    slots_.back().in = std::move(in);
+    slots_.back().done = false;
+  }
+  pool_->Schedule([this, sequence] { Process(sequence); });
+}
+
+template <typename In, typename Out>
+void OrderedPipeline<In, Out>::Finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finishing_) {
+      return;
+    }
+    finishing_ = true;
+  }
+  front_done_.notify_all();
+  consumer_.join();
+}
+
+// Slots are only removed by the consumer once done, so the slot for a
+// sequence number being processed stays in place.  std::deque keeps
+// references valid when adding and removing at the ends.
+template <typename In, typename Out>
+void OrderedPipeline<In, Out>::Process(uint64_t sequence) {
+  const In* in;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in = &slots_[sequence - first_].in;
+  }
+  Out out = process_(*in);
+  // Notify while holding the lock, as the pipeline may be destroyed as soon
+  // as the consumer has seen the last slot.
+  std::lock_guard<std::mutex> lock(mutex_);
+  Slot& slot = slots_[sequence - first_];
+  slot.out = std::move(out);
+  slot.done = true;
+  if (sequence == first_) {
+    front_done_.notify_one();
+  }
+}
+
+template <typename In, typename Out>
+void OrderedPipeline<In, Out>::ConsumerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    front_done_.wait(lock, [this] {
+      return (!slots_.empty() && slots_.front().done) ||
+          (finishing_ && slots_.empty());
+    });
+    if (slots_.empty()) {
+      return;
+    }
+    Out out = std::move(slots_.front().out);
+    slots_.pop_front();
+    ++first_;
+    lock.unlock();
+    slot_free_.notify_one();
+    consume_(out);
+    lock.lock();
+  }
+}
+
+}  // namespace util
+
+#endif  // INFINIPIC_PIPELINE_H_
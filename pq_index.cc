@@ -0,0 +1,172 @@
+#include "pq_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <utility>
+
+#include <opencv2/core/core.hpp>
+
+#include "ssd.h"
+
+namespace match {
+namespace {
+
+// k-means is run on an evenly spaced subset of large libraries.
+const int kMaxTrainingSamples = 20000;
+
+const char kTag[4] = {'P', 'Q', 'I', '1'};
+
+}  // namespace
+
+const int PqIndex::kCentroids;
+
+PqIndex::PqIndex(const uint8_t* base, size_t stride, int count, int dims)
+    : base_(base),
+      stride_(stride),
+      count_(count),
+      dims_(dims),
+      subspaces_(0) {
+}
+
+void PqIndex::Train(int subspaces) {
+  subspaces_ = std::max(1, std::min(subspaces, dims_));
+  centroids_.assign(kCentroids * dims_, 0.0f);
+  int samples = std::min(count_, kMaxTrainingSamples);
+  int k = std::min(samples, static_cast<int>(kCentroids));
+  for (int m = 0; m < subspaces_ && k > 0; ++m) {
+    int sub_dims = begin(m + 1) - begin(m);
+    cv::Mat data(samples, sub_dims, CV_32F);
+    for (int r = 0; r < samples; ++r) {
+      const uint8_t* pixels =
+          point(static_cast<int64_t>(r) * count_ / samples) + begin(m);
+      float* row = data.ptr<float>(r);
+      for (int j = 0; j < sub_dims; ++j) {
+        row[j] = pixels[j];
+      }
+    }
+    cv::Mat labels, centers;
+    cv::kmeans(data, k, labels,
+               cv::TermCriteria(cv::TermCriteria::COUNT +
+                                cv::TermCriteria::EPS, 20, 0.01),
+               1, cv::KMEANS_PP_CENTERS, centers);
+    // With fewer samples than centroids, repeat the first centroid.
+    float* out = &centroids_[kCentroids * begin(m)];
+    for (int c = 0; c < kCentroids; ++c) {
+      const float* center = centers.ptr<float>(c < k ? c : 0);
+      std::copy(center, center + sub_dims, out + c * sub_dims);
+    }
+  }
+
+  codes_.resize(static_cast<size_t>(count_) * subspaces_);
+  std::vector<float> table(kCentroids * subspaces_);
+  for (int i = 0; i < count_; ++i) {
+    DistanceTable(point(i), table.data());
+    for (int m = 0; m < subspaces_; ++m) {
+      const float* distances = &table[kCentroids * m];
+      codes_[static_cast<size_t>(i) * subspaces_ + m] =
+          std::min_element(distances, distances + kCentroids) - distances;
+    }
+  }
+}
+
+std::string PqIndex::Serialize() const {
+  Header header;
+  memcpy(header.tag, kTag, sizeof(kTag));
+  header.count = count_;
+  header.dims = dims_;
+  header.subspaces = subspaces_;
+  std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+  record.append(reinterpret_cast<const char*>(centroids_.data()),
+                centroids_.size() * sizeof(float));
+  record.append(reinterpret_cast<const char*>(codes_.data()), codes_.size());
+  return record;
+}
+
+bool PqIndex::IsPqRecord(const std::string& record) {
+  return record.size() >= sizeof(Header) &&
+      memcmp(record.data(), kTag, sizeof(kTag)) == 0;
+}
+
+bool PqIndex::Parse(const std::string& record) {
+  if (!IsPqRecord(record)) {
+    return false;
+  }
+  Header header;
+  memcpy(&header, record.data(), sizeof(header));
+  if (header.count != count_ || header.dims != dims_ ||
+      header.subspaces < 1 || header.subspaces > dims_) {
+    return false;
+  }
+  size_t centroid_bytes = kCentroids * dims_ * sizeof(float);
+  size_t code_bytes = static_cast<size_t>(count_) * header.subspaces;
+  if (record.size() != sizeof(header) + centroid_bytes + code_bytes) {
+    return false;
+  }
+  subspaces_ = header.subspaces;
+  centroids_.resize(kCentroids * dims_);
+  memcpy(centroids_.data(), record.data() + sizeof(header), centroid_bytes);
+  codes_.assign(record.begin() + sizeof(header) + centroid_bytes,
+                record.end());
+  return true;
+}
+
+int PqIndex::FindClosest(const uint8_t* query, int candidates,
+                         uint64_t* examined) const {
+  std::vector<float> table(kCentroids * subspaces_);
+  DistanceTable(query, table.data());
+
+  // Keep the candidates with the smallest approximate distance in a
+  // max-heap.
+  candidates = std::max(candidates, 1);
+  std::priority_queue<std::pair<float, int>> closest;
+  const uint8_t* code = codes_.data();
+  for (int i = 0; i < count_; ++i, code += subspaces_) {
+    float distance = 0.0f;
+    for (int m = 0; m < subspaces_; ++m) {
+      distance += table[kCentroids * m + code[m]];
+    }
+    if (static_cast<int>(closest.size()) < candidates) {
+      closest.push(std::make_pair(distance, i));
+    } else if (distance < closest.top().first) {
+      closest.pop();
+      closest.push(std::make_pair(distance, i));
+    }
+  }
+
+  int best = -1;
+  int best_diff = std::numeric_limits<int>::max();
+  for (; !closest.empty(); closest.pop()) {
+    int i = closest.top().second;
+    int diff = Ssd(query, point(i), dims_);
+    *examined += dims_;
+    if (diff < best_diff || (diff == best_diff && i < best)) {
+      best_diff = diff;
+      best = i;
+    }
+  }
+  return best;
+}
+
+size_t PqIndex::MemoryUsage() const {
+  return centroids_.capacity() * sizeof(float) + codes_.capacity();
+}
+
+void PqIndex::DistanceTable(const uint8_t* pixels, float* table) const {
+  for (int m = 0; m < subspaces_; ++m) {
+    int sub_dims = begin(m + 1) - begin(m);
+    const uint8_t* sub_pixels = pixels + begin(m);
+    const float* centroid = centroids(m);
+    for (int c = 0; c < kCentroids; ++c, centroid += sub_dims) {
+      float distance = 0.0f;
+      for (int j = 0; j < sub_dims; ++j) {
+        float delta = sub_pixels[j] - centroid[j];
+        distance += delta * delta;
+      }
+      table[kCentroids * m + c] = distance;
+    }
+  }
+}
+
+}  // namespace match
@@ -0,0 +1,94 @@
+// An approximate nearest neighbour index using product quantization.
+//
+// The point dimensions are split into subspaces, and each subspace is
+// quantized to one of 256 centroids learned by k-means, so every point is
+// encoded in one byte per subspace.  A query first computes its squared
+// distance to every centroid of every subspace, after which the approximate
+// distance to any point is a sum of table lookups, one per code byte.  The
+// closest candidates are then re-ranked by their exact SSD (see ssd.h).
+
+#ifndef INFINIPIC_PQ_INDEX_H_
+#define INFINIPIC_PQ_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace match {
+
+class PqIndex {
+ public:
+  static const int kCentroids = 256;
+
+  // Index count points of dims bytes each, where point i starts at
+  // base + i * stride.  The points are not copied and must outlive the index.
+  // The index is not usable until Train() or Parse() succeeds.
+  PqIndex(const uint8_t* base, size_t stride, int count, int dims);
+
+  // Learn the codebooks for the given number of subspaces from a sample of
+  // the points, and encode every point.
+  void Train(int subspaces);
+
+  // Serialize the codebooks and codes, for storing as a single record.
+  std::string Serialize() const;
+
+  // Returns true if the record was written by Serialize.
+  static bool IsPqRecord(const std::string& record);
+
+  // Load a record written by Serialize for the same points.  Fails if the
+  // record does not match the number of points or dimensions.
+  bool Parse(const std::string& record);
+
+  bool trained() const { return subspaces_ > 0; }
+  int subspaces() const { return subspaces_; }
+
+  // Return the index of the point with the smallest SSD to query among the
+  // candidates with the smallest approximate distance, ties going to the
+  // lowest index, or -1 if there are no points.  The number of pixel bytes
+  // compared is added to *examined.
+  int FindClosest(const uint8_t* query, int candidates,
+                  uint64_t* examined) const;
+
+  // Bytes of memory used by the codebooks and codes.
+  size_t MemoryUsage() const;
+
+ private:
+  // Header at the start of a serialized index.
+  struct Header {
+    char tag[4];
+    int32_t count;
+    int32_t dims;
+    int32_t subspaces;
+  };
+
+  const uint8_t* point(int i) const { return base_ + i * stride_; }
+
+  // Subspace m covers dimensions [begin(m), begin(m + 1)).
+  int begin(int m) const {
+    return static_cast<int64_t>(m) * dims_ / subspaces_;
+  }
+
+  // The centroids of subspace m, kCentroids rows of its dimensions.
+  const float* centroids(int m) const {
+    return &centroids_[kCentroids * begin(m)];
+  }
+
+  // Fills table with the squared distance of the subspaces of pixels to every
+  // centroid, kCentroids entries per subspace.
+  void DistanceTable(const uint8_t* pixels, float* table) const;
+
+  const uint8_t* base_;
+  size_t stride_;
+  int count_;
+  int dims_;
+  int subspaces_;
+
+  std::vector<float> centroids_;
+  // Row i holds the code of point i, one byte per subspace.
+  std::vector<uint8_t> codes_;
+};
+
+}  // namespace match
+
+#endif  // INFINIPIC_PQ_INDEX_H_
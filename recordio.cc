@@ -15,14 +15,145 @@
 
 #include "recordio.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <thread>
+
 #include <google/protobuf/message.h>
+#include <zstd.h>
+
+#include "crc32c.h"
 
 namespace file {
+namespace {
+
+// Header of a block in block mode.  It is followed by size bytes holding
+// num_records records, each a uint64_t length and then the data.  If the
+// block is compressed, the size bytes decompress to raw_size bytes of
+// records.  crc is the CRC-32C of the header, with crc set to zero, followed
+// by the size bytes as stored.
+struct BlockHeader {
+  int magic_number;
+  uint32_t num_records;
+  uint64_t size;
+  uint32_t compression;
+  uint32_t crc;
+  uint64_t raw_size;
+};
+
+uint32_t BlockCrc(BlockHeader header, const char* data) {
+  header.crc = 0;
+  uint32_t crc = Crc32c(0, reinterpret_cast<const char*>(&header),
+                        sizeof(header));
+  return Crc32c(crc, data, header.size);
+}
+
+// The index written by Close in block mode: an IndexHeader, an IndexEntry for
+// every block, and an IndexFooter at the very end of the file.
+struct IndexHeader {
+  int magic_number;
+  uint32_t reserved;
+  uint64_t num_blocks;
+};
+
+struct IndexEntry {
+  uint64_t offset;
+  uint64_t first_record;
+};
+
+// crc is the CRC-32C of the IndexHeader and the entries.
+struct IndexFooter {
+  uint64_t index_offset;
+  uint64_t num_records;
+  int magic_number;
+  uint32_t crc;
+};
+
+uint32_t IndexCrc(const IndexHeader& header,
+                  const std::vector<IndexEntry>& entries) {
+  uint32_t crc = Crc32c(0, reinterpret_cast<const char*>(&header),
+                        sizeof(header));
+  return Crc32c(crc, reinterpret_cast<const char*>(entries.data()),
+                entries.size() * sizeof(IndexEntry));
+}
+
+// Size of the chunks searched for the next block header after a corrupt
+// block.
+const size_t kSearchChunk = 1 << 16;
+
+const int kZstdLevel = 1;
+
+}  // namespace
 
 const int RecordWriter::kMagicNumber = 0x3ed7230a;
+const int RecordWriter::kBlockMagicNumber = 0x3ed7230b;
+const int RecordWriter::kIndexMagicNumber = 0x3ed7230c;
+const size_t RecordWriter::kDefaultBlockSize = 1 << 20;
+const int RecordWriter::kDefaultQueuedBlocks = 4;
+
+struct RecordWriter::Background {
+  struct Block {
+    std::vector<char> data;
+    uint32_t num_records;
+    uint64_t first_record;
+  };
+
+  std::thread thread;
+  std::mutex mutex;
+  // Signalled when a block is queued, or when stopping.
+  std::condition_variable queued;
+  // Signalled when a block is taken off the queue, or written.
+  std::condition_variable taken;
+  std::deque<Block> queue;
+  // Buffers of written blocks, reused for new blocks.
+  std::vector<std::vector<char>> free_buffers;
+  size_t max_queued;
+  bool writing;
+  bool stopping;
+  std::atomic<bool> failed;
+};
 
 RecordWriter::RecordWriter(std::ofstream* const file)
-    : file_(file) {
+    : file_(file),
+      block_size_(0),
+      compression_(Compression::kNone),
+      block_records_(0),
+      records_written_(0) {
+}
+
+RecordWriter::RecordWriter(std::ofstream* const file, size_t block_size)
+    : RecordWriter(file, block_size, Compression::kNone) {
+}
+
+RecordWriter::RecordWriter(std::ofstream* const file, size_t block_size,
+                           Compression compression)
+    : file_(file),
+      block_size_(block_size),
+      compression_(compression),
+      block_records_(0),
+      records_written_(0) {
+  block_.reserve(block_size);
+}
+
+RecordWriter::~RecordWriter() {
+  StopBackground();
+}
+
+void RecordWriter::WriteInBackground(int max_queued_blocks) {
+  if (block_size_ == 0 || background_ != nullptr) {
+    return;
+  }
+  background_.reset(new Background());
+  background_->max_queued = std::max(max_queued_blocks, 1);
+  background_->writing = false;
+  background_->stopping = false;
+  background_->failed = false;
+  background_->thread = std::thread(&RecordWriter::BackgroundLoop, this);
 }
 
 bool RecordWriter::WriteProtocolMessage(
@@ -35,89 +166,473 @@ bool RecordWriter::WriteRecord(const std::string& data) {
 }
 
 bool RecordWriter::WriteRecord(const char* buffer, size_t len) {
-  file_->write(reinterpret_cast<const char*>(&kMagicNumber),
-               sizeof(kMagicNumber));
-  file_->write(reinterpret_cast<const char*>(&len), sizeof(len));
-  file_->write(buffer, len);
+  if (block_size_ == 0) {
+    file_->write(reinterpret_cast<const char*>(&kMagicNumber),
+                 sizeof(kMagicNumber));
+    file_->write(reinterpret_cast<const char*>(&len), sizeof(len));
+    file_->write(buffer, len);
+    return !file_->fail();
+  }
+
+  uint64_t length = len;
+  if (block_records_ > 0 &&
+      block_.size() + sizeof(length) + len > block_size_) {
+    if (!FlushBlock()) {
+      return false;
+    }
+  }
+  if (block_.empty()) {
+    block_.resize(sizeof(BlockHeader));
+  }
+  const char* length_bytes = reinterpret_cast<const char*>(&length);
+  block_.insert(block_.end(), length_bytes, length_bytes + sizeof(length));
+  block_.insert(block_.end(), buffer, buffer + len);
+  ++block_records_;
+  return !Failed();
+}
+
+bool RecordWriter::FlushBlock() {
+  if (block_records_ == 0) {
+    return !Failed();
+  }
+  uint32_t num_records = block_records_;
+  uint64_t first_record = records_written_;
+  records_written_ += block_records_;
+  block_records_ = 0;
+  if (background_ == nullptr) {
+    bool written = WriteBlock(&block_, num_records, first_record);
+    block_.clear();
+    return written;
+  }
+
+  Background& background = *background_;
+  std::unique_lock<std::mutex> lock(background.mutex);
+  background.taken.wait(lock, [&background] {
+    return background.queue.size() < background.max_queued;
+  });
+  background.queue.push_back(Background::Block());
+  Background::Block& queued = background.queue.back();
+  queued.data.swap(block_);
+  queued.num_records = num_records;
+  queued.first_record = first_record;
+  if (!background.free_buffers.empty()) {
+    block_.swap(background.free_buffers.back());
+    background.free_buffers.pop_back();
+  }
+  lock.unlock();
+  background.queued.notify_one();
+  block_.reserve(block_size_);
+  return !Failed();
+}
+
+bool RecordWriter::WriteBlock(std::vector<char>* block, uint32_t num_records,
+                              uint64_t first_record) {
+  BlockHeader header;
+  header.magic_number = kBlockMagicNumber;
+  header.num_records = num_records;
+  header.size = block->size() - sizeof(header);
+  header.compression = static_cast<uint32_t>(Compression::kNone);
+  header.raw_size = header.size;
+  std::vector<char>* output = block;
+  if (compression_ == Compression::kZstd) {
+    compressed_.resize(sizeof(header) + ZSTD_compressBound(header.raw_size));
+    size_t size = ZSTD_compress(compressed_.data() + sizeof(header),
+                                compressed_.size() - sizeof(header),
+                                block->data() + sizeof(header),
+                                header.raw_size, kZstdLevel);
+    if (!ZSTD_isError(size) && size < header.raw_size) {
+      header.size = size;
+      header.compression = static_cast<uint32_t>(Compression::kZstd);
+      compressed_.resize(sizeof(header) + size);
+      output = &compressed_;
+    }
+  }
+  header.crc = BlockCrc(header, output->data() + sizeof(header));
+  memcpy(output->data(), &header, sizeof(header));
+  block_offsets_.push_back(file_->tellp());
+  block_first_records_.push_back(first_record);
+  file_->write(output->data(), output->size());
   return !file_->fail();
 }
 
+void RecordWriter::BackgroundLoop() {
+  Background& background = *background_;
+  std::unique_lock<std::mutex> lock(background.mutex);
+  while (true) {
+    background.queued.wait(lock, [&background] {
+      return !background.queue.empty() || background.stopping;
+    });
+    if (background.queue.empty()) {
+      return;
+    }
+    Background::Block block = std::move(background.queue.front());
+    background.queue.pop_front();
+    background.writing = true;
+    lock.unlock();
+    background.taken.notify_all();
+    if (!WriteBlock(&block.data, block.num_records, block.first_record)) {
+      background.failed = true;
+    }
+    block.data.clear();
+    lock.lock();
+    background.free_buffers.push_back(std::move(block.data));
+    background.writing = false;
+    background.taken.notify_all();
+  }
+}
+
+void RecordWriter::StopBackground() {
+  if (background_ == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(background_->mutex);
+    background_->stopping = true;
+  }
+  background_->queued.notify_one();
+  background_->thread.join();
+  // Write errors leave the file failed, so Failed() still reports them.
+  background_.reset();
+}
+
+bool RecordWriter::Failed() const {
+  return background_ != nullptr ? background_->failed.load()
+                                : file_->fail();
+}
+
+bool RecordWriter::Flush() {
+  bool flushed = FlushBlock();
+  if (background_ != nullptr) {
+    // Once the queue is empty and nothing is being written, the background
+    // thread does not touch the file until another block is queued.
+    Background& background = *background_;
+    std::unique_lock<std::mutex> lock(background.mutex);
+    background.taken.wait(lock, [&background] {
+      return background.queue.empty() && !background.writing;
+    });
+  }
+  file_->flush();
+  return flushed && !file_->fail();
+}
 
 bool RecordWriter::Close() {
+  bool flushed = FlushBlock();
+  StopBackground();
+  if (block_size_ > 0) {
+    IndexHeader header;
+    header.magic_number = kIndexMagicNumber;
+    header.reserved = 0;
+    header.num_blocks = block_offsets_.size();
+    IndexFooter footer;
+    footer.index_offset = file_->tellp();
+    footer.num_records = records_written_;
+    footer.magic_number = kIndexMagicNumber;
+    std::vector<IndexEntry> entries(block_offsets_.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      entries[i].offset = block_offsets_[i];
+      entries[i].first_record = block_first_records_[i];
+    }
+    footer.crc = IndexCrc(header, entries);
+    file_->write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file_->write(reinterpret_cast<const char*>(entries.data()),
+                 entries.size() * sizeof(IndexEntry));
+    file_->write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+  }
   file_->close();
-  return file_->fail();
+  return flushed && !file_->fail();
 }
 
 RecordReader::RecordReader(std::ifstream* const file)
-    : file_(file) {
+    : file_(file),
+      block_position_(0),
+      block_size_(0),
+      block_records_(0),
+      next_record_(0),
+      limit_(std::numeric_limits<uint64_t>::max()),
+      verify_checksums_(true),
+      skip_corrupt_blocks_(false),
+      corrupt_blocks_(0),
+      index_read_(false),
+      has_index_(false),
+      num_records_(0),
+      index_offset_(0),
+      file_size_(0) {
 }
 
 bool RecordReader::ReadProtocolMessage(
     google::protobuf::MessageLite* message) {
-  size_t size = 0;
-  const char* buffer;
-  if (!ReadRecord(&buffer, &size)) {
-    return false;
-  }
-  if (!message->ParseFromArray(buffer, size)) {
-    return false;
-  }
-  delete[] buffer;
-  return true;
+  RecordView record;
+  return ReadRecord(&record) &&
+      message->ParseFromArray(record.data, record.size);
 }
 
 bool RecordReader::ReadRecord(std::string* data) {
-  size_t size = 0;
-  const char* buffer;
-  if (!ReadRecord(&buffer, &size)) {
+  RecordView record;
+  if (!ReadRecord(&record)) {
     return false;
   }
-  data->assign(buffer, size);
-  delete[] buffer;
+  data->assign(record.data, record.size);
   return true;
 }
 
 bool RecordReader::ReadRecord(const char** buffer, size_t* len) {
-  int magic_number = 0;
+  const char* record;
   *buffer = nullptr;
-  file_->read(reinterpret_cast<char*>(&magic_number),
-              sizeof(magic_number));
-  if (file_->fail() || (magic_number != RecordWriter::kMagicNumber)) {
-    return false;
-  }
-  file_->read(reinterpret_cast<char*>(len), sizeof(*len));
-  if (file_->fail()) {
+  if (!NextRecord(&record, len)) {
     return false;
   }
   char* data = new char[*len];
-  file_->read(data, *len);
-  if (file_->fail()) {
-    delete[] data;
-    return false;
-  }
+  memcpy(data, record, *len);
   *buffer = data;
   return true;
 }
 
+bool RecordReader::ReadRecord(RecordView* record) {
+  return NextRecord(&record->data, &record->size);
+}
+
 bool RecordReader::Close() {
   file_->close();
-  return file_->fail();
+  return !file_->fail();
 }
 
 bool RecordReader::ReadRecordSized(char* buffer, size_t len) {
-  int magic_number = 0;
-  file_->read(reinterpret_cast<char*>(&magic_number),
-              sizeof(magic_number));
-  if (file_->fail() || (magic_number != RecordWriter::kMagicNumber)) {
+  RecordView record;
+  if (!ReadRecord(&record) || record.size != len) {
     return false;
   }
-  size_t read_len;
-  file_->read(reinterpret_cast<char*>(&read_len), sizeof(read_len));
-  if (file_->fail() || (read_len != len)) {
+  memcpy(buffer, record.data, len);
+  return true;
+}
+
+int64_t RecordReader::NumRecords() {
+  return ReadIndex() ? num_records_ : -1;
+}
+
+bool RecordReader::Seek(uint64_t record_index) {
+  if (!ReadIndex() || record_index > num_records_) {
     return false;
   }
-  file_->read(buffer, len);
-  return !file_->fail();
+  file_->clear();
+  block_records_ = 0;
+  if (record_index == num_records_) {
+    // Reading stops at the index.
+    file_->seekg(index_offset_);
+    next_record_ = record_index;
+    return !file_->fail();
+  }
+  size_t block = std::upper_bound(block_first_records_.begin(),
+                                  block_first_records_.end(), record_index) -
+      block_first_records_.begin() - 1;
+  file_->seekg(block_offsets_[block]);
+  next_record_ = block_first_records_[block];
+  const char* data;
+  size_t len;
+  while (next_record_ < record_index) {
+    if (!ReadNext(&data, &len)) {
+      return false;
+    }
+    ++next_record_;
+  }
+  return true;
+}
+
+bool RecordReader::ReadIndex() {
+  if (index_read_) {
+    return has_index_;
+  }
+  index_read_ = true;
+  // Leave the stream where it was, for reading on from there.
+  file_->clear();
+  std::streampos position = file_->tellg();
+  file_->seekg(0, std::ios::end);
+  uint64_t file_size = file_->tellg();
+  file_size_ = file_size;
+  IndexFooter footer;
+  IndexHeader header;
+  has_index_ = false;
+  if (file_size >= sizeof(header) + sizeof(footer)) {
+    file_->seekg(file_size - sizeof(footer));
+    file_->read(reinterpret_cast<char*>(&footer), sizeof(footer));
+    has_index_ = !file_->fail() &&
+        footer.magic_number == RecordWriter::kIndexMagicNumber &&
+        footer.index_offset <= file_size - sizeof(header) - sizeof(footer);
+  }
+  if (has_index_) {
+    file_->seekg(footer.index_offset);
+    file_->read(reinterpret_cast<char*>(&header), sizeof(header));
+    uint64_t entries_size = file_size - sizeof(footer) - sizeof(header) -
+        footer.index_offset;
+    has_index_ = !file_->fail() &&
+        header.magic_number == RecordWriter::kIndexMagicNumber &&
+        entries_size == header.num_blocks * sizeof(IndexEntry);
+  }
+  if (has_index_) {
+    std::vector<IndexEntry> entries(header.num_blocks);
+    file_->read(reinterpret_cast<char*>(entries.data()),
+                entries.size() * sizeof(IndexEntry));
+    has_index_ = !file_->fail() && IndexCrc(header, entries) == footer.crc;
+    for (size_t i = 0; has_index_ && i < entries.size(); ++i) {
+      has_index_ = entries[i].offset < footer.index_offset &&
+          entries[i].first_record < footer.num_records &&
+          (i == 0 ? entries[i].first_record == 0 :
+           entries[i].first_record > entries[i - 1].first_record);
+      block_offsets_.push_back(entries[i].offset);
+      block_first_records_.push_back(entries[i].first_record);
+    }
+  }
+  if (has_index_) {
+    num_records_ = footer.num_records;
+    index_offset_ = footer.index_offset;
+  } else {
+    block_offsets_.clear();
+    block_first_records_.clear();
+  }
+  file_->clear();
+  file_->seekg(position);
+  return has_index_;
+}
+
+bool RecordReader::NextRecord(const char** data, size_t* len) {
+  if (next_record_ >= limit_ || !ReadNext(data, len)) {
+    return false;
+  }
+  ++next_record_;
+  return true;
+}
+
+bool RecordReader::ReadNext(const char** data, size_t* len) {
+  while (block_records_ == 0) {
+    uint64_t position = file_->tellg();
+    int magic_number = 0;
+    file_->read(reinterpret_cast<char*>(&magic_number),
+                sizeof(magic_number));
+    if (file_->fail() ||
+        magic_number == RecordWriter::kIndexMagicNumber) {
+      return false;
+    }
+    if (magic_number == RecordWriter::kMagicNumber) {
+      file_->read(reinterpret_cast<char*>(len), sizeof(*len));
+      if (file_->fail()) {
+        return false;
+      }
+      buffer_.resize(*len);
+      file_->read(buffer_.data(), *len);
+      *data = buffer_.data();
+      return !file_->fail();
+    }
+    if (magic_number != RecordWriter::kBlockMagicNumber ||
+        !ReadBlock(position)) {
+      if (!skip_corrupt_blocks_ || !SkipCorruptBlock(position)) {
+        return false;
+      }
+      ++corrupt_blocks_;
+    }
+  }
+
+  uint64_t length;
+  if (block_size_ - block_position_ < sizeof(length)) {
+    return false;
+  }
+  memcpy(&length, buffer_.data() + block_position_, sizeof(length));
+  block_position_ += sizeof(length);
+  if (block_size_ - block_position_ < length) {
+    return false;
+  }
+  *data = buffer_.data() + block_position_;
+  *len = length;
+  block_position_ += length;
+  --block_records_;
+  return true;
+}
+
+bool RecordReader::ReadBlock(uint64_t position) {
+  BlockHeader header;
+  header.magic_number = RecordWriter::kBlockMagicNumber;
+  file_->read(reinterpret_cast<char*>(&header) + sizeof(header.magic_number),
+              sizeof(header) - sizeof(header.magic_number));
+  if (file_->fail()) {
+    return false;
+  }
+  // Check the size before allocating, it may be corrupt.  Reading the index
+  // also finds the size of the file.
+  ReadIndex();
+  if (header.size > file_size_ - position - sizeof(header)) {
+    return false;
+  }
+  bool compressed =
+      header.compression == static_cast<uint32_t>(Compression::kZstd);
+  if (!compressed &&
+      header.compression != static_cast<uint32_t>(Compression::kNone)) {
+    return false;
+  }
+  std::vector<char>* stored = compressed ? &compressed_ : &buffer_;
+  stored->resize(header.size);
+  file_->read(stored->data(), header.size);
+  if (file_->fail() ||
+      (verify_checksums_ && BlockCrc(header, stored->data()) != header.crc)) {
+    return false;
+  }
+  if (compressed) {
+    // Check the raw size against the one zstd stored in the frame before
+    // allocating, as without checksums it may be corrupt.
+    if (ZSTD_getFrameContentSize(compressed_.data(), compressed_.size()) !=
+        header.raw_size) {
+      return false;
+    }
+    buffer_.resize(header.raw_size);
+    size_t size = ZSTD_decompress(buffer_.data(), buffer_.size(),
+                                  compressed_.data(), compressed_.size());
+    if (ZSTD_isError(size) || size != header.raw_size) {
+      return false;
+    }
+  } else if (header.raw_size != header.size) {
+    return false;
+  }
+  block_position_ = 0;
+  block_size_ = header.raw_size;
+  block_records_ = header.num_records;
+  return true;
+}
+
+bool RecordReader::SkipCorruptBlock(uint64_t position) {
+  file_->clear();
+  if (ReadIndex()) {
+    auto next = std::upper_bound(block_offsets_.begin(),
+                                 block_offsets_.end(), position);
+    if (next == block_offsets_.end()) {
+      return false;
+    }
+    file_->seekg(*next);
+    next_record_ = block_first_records_[next - block_offsets_.begin()];
+    return !file_->fail();
+  }
+
+  // Search for the next block magic number.  If it turns out not to start a
+  // valid block, the search continues from there.
+  int magic_number = RecordWriter::kBlockMagicNumber;
+  const char* magic = reinterpret_cast<const char*>(&magic_number);
+  std::vector<char> chunk(kSearchChunk + sizeof(magic_number));
+  uint64_t start = position + 1;
+  while (start < file_size_) {
+    file_->clear();
+    file_->seekg(start);
+    file_->read(chunk.data(), chunk.size());
+    size_t read = file_->gcount();
+    if (read < sizeof(magic_number)) {
+      return false;
+    }
+    char* end = chunk.data() + read;
+    char* found = std::search(chunk.data(), end, magic,
+                              magic + sizeof(magic_number));
+    if (found != end) {
+      file_->clear();
+      file_->seekg(start + (found - chunk.data()));
+      return !file_->fail();
+    }
+    start += read - (sizeof(magic_number) - 1);
+  }
+  return false;
 }
 
 }  // namespace file
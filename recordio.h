@@ -1,9 +1,28 @@
 // Record input and output - classes to append / read proto buffers from
 // binary files.  Modified from: https://code.google.com/p/or-tools/
 //
-// These RecordIO implementations only have a minimal safety against corruption
-// in the form of a magic number written with every record.  Specifically, no
-// checksums are computed.
+// Records are written either one at a time, each preceded by a magic number
+// and its length, or in block mode, where many records are packed into one
+// block with a single header and written with a single call.  Block mode is
+// much faster for small records.  RecordReader reads files in either format.
+//
+// In block mode, full blocks can also be compressed and written on a
+// background I/O thread, so that writing records only copies them into a
+// buffer, and only waits for the disk when it falls behind.
+//
+// Blocks may be compressed, with the codec recorded in the block header.
+// Blocks are decompressed by the reader that reads them, so readers of
+// disjoint ranges (see below) also decompress in parallel.
+//
+// In block mode, Close also writes an index of where every block starts at
+// the end of the file, so that RecordReader can seek to any record, and
+// several readers can read disjoint ranges of a file in parallel.
+//
+// Every block carries a CRC-32C of its header and contents, which
+// RecordReader checks by default.  It can also skip corrupt blocks, for
+// example after a partial write, and carry on with the next valid one.
+// Records written one at a time only have a minimal safety against
+// corruption in the form of a magic number written with every record.
 
 // Copyright 2011 Google
 // Licensed under the Apache License, Version 2.0 (the "License");
@@ -21,10 +40,12 @@
 #ifndef INFINIPIC_RECORDIO_H_
 #define INFINIPIC_RECORDIO_H_
 
+#include <cstdint>
 #include <fstream>
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 namespace google {
 namespace protobuf {
@@ -34,15 +55,50 @@ class MessageLite;
 
 namespace file {
 
+// How blocks are compressed.  The values are stored in block headers.
+enum class Compression {
+  kNone = 0,
+  // zstd at a low level, which decompresses at well over 1 GB/s per core.
+  kZstd = 1,
+};
+
 // This class appends a protocol buffer to a file in a binary format.
 class RecordWriter {
  public:
   static const int kMagicNumber;
+  static const int kBlockMagicNumber;
+  static const int kIndexMagicNumber;
+
+  // A good block size for block mode.
+  static const size_t kDefaultBlockSize;
+  // A good number of blocks to queue for writing in the background.
+  static const int kDefaultQueuedBlocks;
 
-  // Write to the provided file.  RecordWriter does not take ownership of
-  // the file.
+  // Write to the provided file, one record at a time.  RecordWriter does not
+  // take ownership of the file.
   explicit RecordWriter(std::ofstream* const file);
 
+  // Write to the provided file in block mode, with blocks of at most
+  // block_size bytes unless a single record needs more.  Records are
+  // buffered until their block is full, so write errors may only be reported
+  // by a later call, or by Close.
+  RecordWriter(std::ofstream* const file, size_t block_size);
+
+  // Write in block mode, compressing every block.  Blocks that do not get
+  // smaller are stored uncompressed.
+  RecordWriter(std::ofstream* const file, size_t block_size,
+               Compression compression);
+
+  // Waits for blocks queued for writing in the background, but does not
+  // close the file.
+  ~RecordWriter();
+
+  // In block mode, compress and write full blocks on a background I/O
+  // thread.  Write* calls then only wait when max_queued_blocks blocks are
+  // already waiting to be written, and report errors from earlier blocks.
+  // Must be called before writing any record.
+  void WriteInBackground(int max_queued_blocks);
+
   // Convenience method for directly writing a protocol buffer.
   bool WriteProtocolMessage(const google::protobuf::MessageLite& message);
   
@@ -56,11 +112,58 @@ class RecordWriter {
   template <typename T>
   bool Write(const T& t);
   
-  // Close the underlying file.  Any further calls to Write* are undefined.
+  // Write any buffered records, as a block of their own in block mode, and
+  // flush the file, returning false if anything failed to be written so far.
+  bool Flush();
+
+  // Write any buffered records, and the index in block mode, and close the
+  // underlying file, returning false if anything failed to be written.  Any
+  // further calls to Write* are undefined.
   bool Close();
 
  private:
+  // The background I/O thread and the blocks queued for it.
+  struct Background;
+
+  // Write the buffered block, if any, or queue it for the background thread.
+  bool FlushBlock();
+
+  // Compress and write a block, with space for its header at the start.
+  bool WriteBlock(std::vector<char>* block, uint32_t num_records,
+                  uint64_t first_record);
+
+  void BackgroundLoop();
+
+  // Write all queued blocks and stop the background thread, if any.
+  void StopBackground();
+
+  // Whether writing failed, which is safe to call while blocks are being
+  // written in the background.
+  bool Failed() const;
+
   std::ofstream* const file_;
+  // Zero if not in block mode.
+  const size_t block_size_;
+  const Compression compression_;
+  // The block being filled, starting with space for its header.
+  std::vector<char> block_;
+  uint32_t block_records_;
+  // Space for a compressed block and its header.
+  std::vector<char> compressed_;
+  // Records in blocks already written or queued.
+  uint64_t records_written_;
+  // File offset and first record of every block written, for the index.
+  std::vector<uint64_t> block_offsets_;
+  std::vector<uint64_t> block_first_records_;
+  // Null unless writing in the background.
+  std::unique_ptr<Background> background_;
+};
+
+// A record returned by RecordReader::ReadRecord(RecordView*).  It points into
+// a buffer owned by the reader, and stays valid until the next read.
+struct RecordView {
+  const char* data;
+  size_t size;
 };
 
 // This class reads a protocol buffer from a file.
@@ -73,24 +176,95 @@ class RecordReader {
   // Convenience method for directly reading a protocol buffer.
   bool ReadProtocolMessage(google::protobuf::MessageLite* message);
 
-  // Read a single record into the given string.
+  // Read a single record into the given string.  Reusing the string avoids
+  // allocating memory for every record.
   bool ReadRecord(std::string* data);
 
   // Read a single record, storing the result in buffer.  The size of read data
   // is returned in len.  Caller assumes ownership of the data in buffer.
   bool ReadRecord(const char** buffer, size_t* len);
 
+  // Read a single record without copying it.  Records are read into a buffer
+  // that is reused, a whole block at a time in block mode, so this does not
+  // allocate memory for every record.
+  bool ReadRecord(RecordView* record);
+
   // Read a single record of a given type, only works for POD.
   template <typename T>
   bool Read(T* t);
 
+  // The number of records in the file, or -1 if it has no index.
+  int64_t NumRecords();
+
+  // Position the reader so that the next record read is the one with the
+  // given index, counting from zero.  Returns false if the file has no index
+  // or fewer records.
+  bool Seek(uint64_t record_index);
+
+  // Stop reading before the record with the given index.  Together with
+  // Seek, this lets readers on separate streams read disjoint ranges of one
+  // file in parallel.
+  void SetLimit(uint64_t end) { limit_ = end; }
+
+  // Check the checksum of every block read, on by default.  Blocks that do
+  // not match are corrupt.
+  void SetVerifyChecksums(bool verify) { verify_checksums_ = verify; }
+
+  // On a corrupt block, skip to the next valid block rather than stop
+  // reading.  The next block is found with the index if the file has one,
+  // and by searching for the next block header otherwise.  Records in the
+  // corrupt block are lost, and without an index record numbers are no longer
+  // known, so Seek and SetLimit should not be used afterwards.
+  void SetSkipCorruptBlocks(bool skip) { skip_corrupt_blocks_ = skip; }
+
+  // The number of corrupt blocks skipped so far.
+  int64_t corrupt_blocks() const { return corrupt_blocks_; }
+
   // Close the underlying file.  Any further calls to Read* are undefined.
   bool Close();
 
  private:
   bool ReadRecordSized(char* buffer, size_t len);
-  
+
+  // Find the next record, reading the next block if the current one is used
+  // up.  The data stays valid until the next call.
+  bool NextRecord(const char** data, size_t* len);
+  bool ReadNext(const char** data, size_t* len);
+
+  // Read, check and decompress the block starting at the given position,
+  // whose magic number was just read.  Returns false if it is corrupt.
+  bool ReadBlock(uint64_t position);
+
+  // Position the stream at the first valid looking block after the corrupt
+  // block starting at the given position.  Returns false if there is none.
+  bool SkipCorruptBlock(uint64_t position);
+
+  // Read the index at the end of the file, if not done yet.  Returns false
+  // if there is none.
+  bool ReadIndex();
+
   std::ifstream* const file_;
+  // The current block, or the current record when not reading blocks.
+  std::vector<char> buffer_;
+  // The current block before decompressing it.
+  std::vector<char> compressed_;
+  size_t block_position_;
+  size_t block_size_;
+  uint32_t block_records_;
+  // Index of the next record, if known.
+  uint64_t next_record_;
+  uint64_t limit_;
+  bool verify_checksums_;
+  bool skip_corrupt_blocks_;
+  int64_t corrupt_blocks_;
+
+  bool index_read_;
+  bool has_index_;
+  uint64_t num_records_;
+  uint64_t index_offset_;
+  uint64_t file_size_;
+  std::vector<uint64_t> block_offsets_;
+  std::vector<uint64_t> block_first_records_;
 };
 
 template <typename T>
@@ -0,0 +1,203 @@
+#include "ssd.h"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <immintrin.h>
+
+namespace match {
+namespace {
+
+// Adds up the 32 bit lanes of v.
+__attribute__((target("sse4.1")))
+int HorizontalSum(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+// Squared differences of 8 bytes widened to 16 bits, summed pairwise into
+// 4 32 bit lanes.
+__attribute__((target("sse4.1")))
+__m128i SquaredDiff8(__m128i a, __m128i b) {
+  __m128i d = _mm_sub_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+  return _mm_madd_epi16(d, d);
+}
+
+// As above, with 16 bytes into 8 32 bit lanes.
+__attribute__((target("avx2")))
+__m256i SquaredDiff16(__m128i a, __m128i b) {
+  __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(a),
+                               _mm256_cvtepu8_epi16(b));
+  return _mm256_madd_epi16(d, d);
+}
+
+SsdFunction BestSsdFunction() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SsdAvx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return SsdSse41;
+  }
+  return SsdScalar;
+}
+
+struct NamedSsdFunction {
+  const char* name;
+  SsdFunction function;
+  const char* cpu_feature;
+};
+
+const NamedSsdFunction kSsdFunctions[] = {
+  {"scalar", SsdScalar, nullptr},
+  {"sse4.1", SsdSse41, "sse4.1"},
+  {"avx2", SsdAvx2, "avx2"},
+};
+
+bool Supported(const NamedSsdFunction& f) {
+  __builtin_cpu_init();
+  if (f.cpu_feature == nullptr) {
+    return true;
+  }
+  // __builtin_cpu_supports only accepts string literals.
+  if (std::string(f.cpu_feature) == "sse4.1") {
+    return __builtin_cpu_supports("sse4.1");
+  }
+  return __builtin_cpu_supports("avx2");
+}
+
+SsdFunction ssd_function = BestSsdFunction();
+
+}  // namespace
+
+int SsdScalar(const uint8_t* a, const uint8_t* b, int n) {
+  int diff = 0;
+  for (int i = 0; i < n; ++i) {
+    diff += (a[i] - b[i]) * (a[i] - b[i]);
+  }
+  return diff;
+}
+
+__attribute__((target("sse4.1")))
+int SsdSse41(const uint8_t* a, const uint8_t* b, int n) {
+  __m128i sum = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    sum = _mm_add_epi32(sum, SquaredDiff8(va, vb));
+    sum = _mm_add_epi32(sum, SquaredDiff8(_mm_srli_si128(va, 8),
+                                          _mm_srli_si128(vb, 8)));
+  }
+  return HorizontalSum(sum) + SsdScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int SsdAvx2(const uint8_t* a, const uint8_t* b, int n) {
+  __m256i sum0 = _mm256_setzero_si256();
+  __m256i sum1 = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    sum0 = _mm256_add_epi32(sum0, SquaredDiff16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+    sum1 = _mm256_add_epi32(sum1, SquaredDiff16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 16)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 16))));
+  }
+  if (i + 16 <= n) {
+    sum0 = _mm256_add_epi32(sum0, SquaredDiff16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+    i += 16;
+  }
+  __m256i sum = _mm256_add_epi32(sum0, sum1);
+  return HorizontalSum(_mm_add_epi32(_mm256_castsi256_si128(sum),
+                                     _mm256_extracti128_si256(sum, 1))) +
+      SsdScalar(a + i, b + i, n - i);
+}
+
+std::string SsdFunctionName() {
+  for (const NamedSsdFunction& f : kSsdFunctions) {
+    if (f.function == ssd_function) {
+      return f.name;
+    }
+  }
+  return "unknown";
+}
+
+bool SelectSsdFunction(const std::string& name) {
+  if (name == "auto") {
+    ssd_function = BestSsdFunction();
+    return true;
+  }
+  for (const NamedSsdFunction& f : kSsdFunctions) {
+    if (name == f.name && Supported(f)) {
+      ssd_function = f.function;
+      return true;
+    }
+  }
+  return false;
+}
+
+int Ssd(const uint8_t* a, const uint8_t* b, int n) {
+  return ssd_function(a, b, n);
+}
+
+int SsdBounded(const uint8_t* a, const uint8_t* b, int n, int block,
+               int bound, uint64_t* examined) {
+  int diff = 0;
+  for (int i = 0; i < n; i += block) {
+    int len = std::min(block, n - i);
+    diff += ssd_function(a + i, b + i, len);
+    *examined += len;
+    if (diff > bound) {
+      break;
+    }
+  }
+  return diff;
+}
+
+bool VerifySsdKernels() {
+  const int kMaxLength = 3 * 20 * 15 + 64;
+  std::mt19937 rng(17);
+  std::uniform_int_distribution<int> byte(0, 255);
+  // Room for every misalignment of the longest inputs.
+  std::vector<uint8_t> a(kMaxLength + 15), b(kMaxLength + 15);
+
+  bool ok = true;
+  for (const NamedSsdFunction& f : kSsdFunctions) {
+    if (!Supported(f)) {
+      std::cerr << "Skipping unsupported SSD kernel " << f.name << std::endl;
+      continue;
+    }
+    for (int trial = 0; trial < 4; ++trial) {
+      for (size_t i = 0; i < a.size(); ++i) {
+        switch (trial) {
+          case 0: a[i] = byte(rng); b[i] = byte(rng); break;
+          case 1: a[i] = 255; b[i] = 0; break;
+          case 2: a[i] = 0; b[i] = 255; break;
+          case 3: a[i] = byte(rng); b[i] = a[i]; break;
+        }
+      }
+      // Test every length, and every misalignment of the inputs.
+      for (int n = 0; n <= kMaxLength; ++n) {
+        int offset = n % 16;
+        int expected = SsdScalar(&a[offset], &b[15 - offset], n);
+        int actual = f.function(&a[offset], &b[15 - offset], n);
+        if (actual != expected) {
+          std::cerr << "SSD kernel " << f.name << " mismatch for n = " << n
+                    << ", trial " << trial << ": expected " << expected
+                    << ", got " << actual << std::endl;
+          ok = false;
+        }
+      }
+    }
+  }
+  return ok;
+}
+
+}  // namespace match
@@ -0,0 +1,55 @@
+// Sum of squared differences (SSD) kernels for comparing blocks of pixels.
+//
+// Every kernel computes sum over i of (a[i] - b[i])^2 for n bytes, and all of
+// them return exactly the same result.  SsdScalar is the reference, the SIMD
+// versions may only be called on a CPU that supports them.  Most callers
+// should just use Ssd(), which dispatches to the fastest kernel supported by
+// the running CPU.
+//
+// The result is an int, so n must be below 2^31 / 255^2 (about 33000 bytes).
+
+#ifndef INFINIPIC_SSD_H_
+#define INFINIPIC_SSD_H_
+
+#include <cstdint>
+#include <string>
+
+namespace match {
+
+typedef int (*SsdFunction)(const uint8_t* a, const uint8_t* b, int n);
+
+// The plain C++ reference kernel.
+int SsdScalar(const uint8_t* a, const uint8_t* b, int n);
+
+// Requires SSE4.1.
+int SsdSse41(const uint8_t* a, const uint8_t* b, int n);
+
+// Requires AVX2.
+int SsdAvx2(const uint8_t* a, const uint8_t* b, int n);
+
+// Returns the name of the kernel currently used by Ssd().
+std::string SsdFunctionName();
+
+// Force Ssd() to use the kernel with the given name, one of "auto", "scalar",
+// "sse4.1" or "avx2".  Returns false if the name is unknown or the kernel is
+// not supported on this CPU, in which case the current kernel is kept.
+bool SelectSsdFunction(const std::string& name);
+
+// Compute the SSD of a and b with the selected kernel.
+int Ssd(const uint8_t* a, const uint8_t* b, int n);
+
+// Like Ssd(), but sums block bytes at a time and gives up as soon as the
+// running sum exceeds bound, in which case the (partial) sum returned is
+// greater than bound.  A result <= bound is always the exact SSD.  The number
+// of bytes compared is added to *examined.
+int SsdBounded(const uint8_t* a, const uint8_t* b, int n, int block,
+               int bound, uint64_t* examined);
+
+// Check that every kernel supported on this CPU is bit-exact with SsdScalar,
+// on random data, extreme values and all lengths up to 964 bytes, a thumbnail
+// and then some.  Mismatches are reported on stderr.
+bool VerifySsdKernels();
+
+}  // namespace match
+
+#endif  // INFINIPIC_SSD_H_
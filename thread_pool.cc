@@ -0,0 +1,164 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace util {
+namespace {
+
+// The pool and worker index of the current thread, if it is a worker.
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+}  // namespace
+
+struct ThreadPool::ForState {
+  std::function<void(int, int)> fn;
+  int grain;
+  std::atomic<int> remaining;
+  std::mutex mutex;
+  std::condition_variable done;
+};
+
+ThreadPool::ThreadPool(int num_threads)
+    : pending_(0),
+      next_worker_(0),
+      stopping_(false) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(new Worker());
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Schedule(std::function<void()> task) {
+  Push(CurrentWorker(), std::move(task));
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grain,
+                             const std::function<void(int, int)>& fn) {
+  if (begin >= end) {
+    return;
+  }
+  std::shared_ptr<ForState> state(new ForState());
+  state->fn = fn;
+  state->grain = std::max(grain, 1);
+  state->remaining = end - begin;
+  RunRange(state, begin, end);
+
+  // Help with the remaining tasks, which need not be ours, until every
+  // element is done.
+  int worker = CurrentWorker();
+  while (state->remaining > 0) {
+    std::function<void()> task;
+    if (TakeTask(worker, &task)) {
+      task();
+    } else {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->done.wait_for(lock, std::chrono::milliseconds(1),
+                           [&state] { return state->remaining == 0; });
+    }
+  }
+}
+
+int ThreadPool::CurrentWorker() const {
+  return current_pool == this ? current_worker : -1;
+}
+
+bool ThreadPool::TakeTask(int worker, std::function<void()>* task) {
+  if (worker >= 0) {
+    Worker& own = *workers_[worker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      *task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      --pending_;
+      return true;
+    }
+  }
+  int n = workers_.size();
+  int start = worker >= 0 ? worker + 1 : next_worker_++ % n;
+  for (int i = 0; i < n; ++i) {
+    Worker& victim = *workers_[(start + i) % n];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      *task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      --pending_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::Push(int worker, std::function<void()> task) {
+  if (worker < 0) {
+    worker = next_worker_++ % workers_.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    ++pending_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(workers_[worker]->mutex);
+    workers_[worker]->tasks.push_back(std::move(task));
+  }
+  wake_.notify_one();
+}
+
+void ThreadPool::RunRange(const std::shared_ptr<ForState>& state,
+                          int begin, int end) {
+  while (end - begin > state->grain) {
+    // Split on a multiple of grain, so every call but the last gets exactly
+    // grain elements.
+    int grains = (end - begin + state->grain - 1) / state->grain;
+    int middle = begin + grains / 2 * state->grain;
+    Push(CurrentWorker(), [this, state, middle, end] {
+      RunRange(state, middle, end);
+    });
+    end = middle;
+  }
+  state->fn(begin, end);
+  if ((state->remaining -= end - begin) == 0) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->done.notify_all();
+  }
+}
+
+void ThreadPool::WorkerLoop(int worker) {
+  current_pool = this;
+  current_worker = worker;
+  while (true) {
+    std::function<void()> task;
+    if (TakeTask(worker, &task)) {
+      task();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    if (pending_ > 0) {
+      // A task is being pushed, try again.
+      continue;
+    }
+    if (stopping_) {
+      return;
+    }
+    wake_.wait(lock);
+  }
+}
+
+}  // namespace util
@@ -0,0 +1,89 @@
+// A work-stealing thread pool.
+//
+// Every worker has its own deque of tasks.  A worker pushes and pops tasks at
+// the back of its own deque, and when that runs dry steals from the front of
+// another worker's deque, where the oldest (and for ParallelFor, largest)
+// tasks are.  This keeps all threads busy even when tasks take very
+// different amounts of time.
+//
+// Example:
+//   util::ThreadPool pool(8);
+//   pool.ParallelFor(0, n, 16, [&](int begin, int end) {
+//     for (int i = begin; i < end; ++i) out[i] = f(in[i]);
+//   });
+
+#ifndef INFINIPIC_THREAD_POOL_H_
+#define INFINIPIC_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+class ThreadPool {
+ public:
+  // Start the given number of worker threads, or one per core if
+  // num_threads <= 0.
+  explicit ThreadPool(int num_threads);
+
+  // Waits for all scheduled tasks to finish.
+  ~ThreadPool();
+
+  int num_threads() const { return workers_.size(); }
+
+  // Run task on some worker thread at some point.
+  void Schedule(std::function<void()> task);
+
+  // Call fn(begin, end) on disjoint sub-ranges covering [begin, end), each
+  // of grain elements except the last, which may be shorter, and return once
+  // all calls are done.  The
+  // range is split recursively, so idle workers steal large halves.  The
+  // calling thread helps run tasks while it waits, so ParallelFor may also
+  // be called from inside a task.
+  void ParallelFor(int begin, int end, int grain,
+                   const std::function<void(int, int)>& fn);
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  // State shared by the tasks of one ParallelFor call.
+  struct ForState;
+
+  // Index of the worker running on this thread, or -1 for other threads.
+  int CurrentWorker() const;
+
+  // Pop a task from the back of worker's own deque, or steal one from the
+  // front of another.  Returns false if there was no task anywhere.
+  bool TakeTask(int worker, std::function<void()>* task);
+
+  void Push(int worker, std::function<void()> task);
+
+  // Run a ParallelFor over [begin, end), pushing the upper halves as new
+  // tasks until the range fits in one grain.
+  void RunRange(const std::shared_ptr<ForState>& state, int begin, int end);
+
+  void WorkerLoop(int worker);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  // Tasks scheduled but not yet taken, used to put idle workers to sleep.
+  std::atomic<int> pending_;
+  std::atomic<unsigned> next_worker_;
+  bool stopping_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+};
+
+}  // namespace util
+
+#endif  // INFINIPIC_THREAD_POOL_H_
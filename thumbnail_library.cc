@@ -0,0 +1,857 @@
+#include "thumbnail_library.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+
+#include "mapped_file.h"
+#include "pca_index.h"
+#include "pq_index.h"
+#include "recordio.h"
+#include "ssd.h"
+#include "thread_pool.h"
+#include "vptree.h"
+
+namespace {
+
+const int kThumbnailBytes = sizeof(Thumbnail::pixels);
+const int kRowBytes = 3 * Thumbnail::kWidth;
+
+// Thumbnails per block in FindClosestBatch.  A block of kBatchTiles tiles and
+// a block of thumbnails together take about 190 KiB, which fits in L2.
+const int kThumbnailBlock = 64;
+
+// Thumbnail and skipped photo records start with this header.  Thumbnail
+// records continue with the pixels, and both end with the filename.
+struct PhotoRecordHeader {
+  char tag[4];
+  uint32_t filename_size;
+  int64_t file_size;
+  int64_t mtime;
+};
+
+const char kThumbnailTag[4] = {'T', 'H', 'M', '2'};
+const char kSkippedTag[4] = {'S', 'K', 'P', '2'};
+
+// Records written before filenames could be longer than 255 characters.  The
+// oldest thumbnail records also lack file_size and mtime.
+struct LegacyThumbnail {
+  char filename[256];
+  uint8_t pixels[kThumbnailBytes];
+  int64_t file_size;
+  int64_t mtime;
+};
+
+struct LegacySkippedPhoto {
+  char filename[256];
+  int64_t file_size;
+  int64_t mtime;
+};
+
+const size_t kOldestThumbnailRecordBytes = 256 + kThumbnailBytes;
+
+// Header of the memory mapped copy of a library.  Every section starts at the
+// given offset, and pq_bytes is zero if there is no product quantization
+// record.  library_size is the size of the library file it was copied from.
+struct MappedHeader {
+  char magic[8];
+  uint32_t thumbnail_bytes;
+  uint32_t reserved;
+  uint64_t library_size;
+  uint64_t count;
+  uint64_t pixels_offset;
+  uint64_t info_offset;
+  uint64_t names_offset;
+  uint64_t names_bytes;
+  uint64_t pq_offset;
+  uint64_t pq_bytes;
+};
+
+const char kMappedMagic[8] = {'I', 'N', 'F', 'M', 'A', 'P', '0', '3'};
+
+// Pixels start on a cache line, after the header.
+const uint64_t kMappedPixelsOffset = 128;
+
+bool IsApproximate(MatchMode mode) {
+  return mode == MatchMode::kPca || mode == MatchMode::kPq;
+}
+
+std::string EncodePhotoRecord(const char* tag, const std::string& filename,
+                              int64_t file_size, int64_t mtime,
+                              const uint8_t* pixels) {
+  PhotoRecordHeader header;
+  memcpy(header.tag, tag, sizeof(header.tag));
+  header.filename_size = filename.size();
+  header.file_size = file_size;
+  header.mtime = mtime;
+  std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (pixels != nullptr) {
+    record.append(reinterpret_cast<const char*>(pixels), kThumbnailBytes);
+  }
+  record.append(filename);
+  return record;
+}
+
+// Check if a record was written by EncodePhotoRecord with the given tag,
+// and if so parse its header.  The pixels follow the header, and the
+// filename follows the pixels.
+bool ParsePhotoRecord(const file::RecordView& record, const char* tag,
+                      size_t pixel_bytes, PhotoRecordHeader* header) {
+  if (record.size < sizeof(*header) + pixel_bytes) {
+    return false;
+  }
+  memcpy(header, record.data, sizeof(*header));
+  return memcmp(header->tag, tag, sizeof(header->tag)) == 0 &&
+      record.size == sizeof(*header) + pixel_bytes + header->filename_size;
+}
+
+}  // namespace
+
+const int Thumbnail::kWidth;
+const int Thumbnail::kHeight;
+const int ThumbnailLibrary::kBatchTiles;
+
+bool ParseMatchMode(const std::string& name, MatchMode* mode) {
+  if (name == "exhaustive") {
+    *mode = MatchMode::kExhaustive;
+  } else if (name == "partial") {
+    *mode = MatchMode::kPartial;
+  } else if (name == "vptree") {
+    *mode = MatchMode::kVpTree;
+  } else if (name == "pca") {
+    *mode = MatchMode::kPca;
+  } else if (name == "pq") {
+    *mode = MatchMode::kPq;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+ThumbnailLibrary::ThumbnailLibrary()
+    : pixels_(nullptr),
+      info_(nullptr),
+      names_(nullptr),
+      names_size_(0),
+      count_(0),
+      library_size_(0),
+      mode_(MatchMode::kExhaustive),
+      mean_color_order_(false),
+      pca_dims_(32),
+      pca_candidates_(64),
+      pq_subspaces_(16),
+      pq_candidates_(16),
+      measure_recall_(false),
+      queries_(0),
+      bytes_examined_(0),
+      recall_queries_(0),
+      recall_hits_(0) {
+}
+
+ThumbnailLibrary::~ThumbnailLibrary() {
+}
+
+void ThumbnailLibrary::Add(const Thumbnail& thumbnail) {
+  // The indices point into the pixels, which may be reallocated.
+  ResetIndex();
+  if (mapped_) {
+    owned_pixels_.assign(
+        pixels_, pixels_ + static_cast<size_t>(count_) * kThumbnailBytes);
+    owned_info_.assign(info_, info_ + count_);
+    owned_names_.assign(names_, names_ + names_size_);
+    mapped_.reset();
+  }
+  pq_record_.clear();
+  owned_pixels_.insert(owned_pixels_.end(), thumbnail.pixels,
+                       thumbnail.pixels + kThumbnailBytes);
+  PhotoInfo info;
+  info.filename_offset = owned_names_.size();
+  info.file_size = thumbnail.file_size;
+  info.mtime = thumbnail.mtime;
+  owned_info_.push_back(info);
+  owned_names_.insert(owned_names_.end(), thumbnail.filename.begin(),
+                      thumbnail.filename.end());
+  owned_names_.push_back('\0');
+  UseOwned();
+}
+
+void ThumbnailLibrary::AddSkipped(const SkippedPhoto& skipped) {
+  skipped_.push_back(skipped);
+}
+
+bool ThumbnailLibrary::WriteThumbnail(file::RecordWriter* record_writer,
+                                      const Thumbnail& thumbnail) {
+  return record_writer->WriteRecord(EncodePhotoRecord(
+      kThumbnailTag, thumbnail.filename, thumbnail.file_size,
+      thumbnail.mtime, thumbnail.pixels));
+}
+
+bool ThumbnailLibrary::WriteSkipped(file::RecordWriter* record_writer,
+                                    const SkippedPhoto& skipped) {
+  return record_writer->WriteRecord(EncodePhotoRecord(
+      kSkippedTag, skipped.filename, skipped.file_size, skipped.mtime,
+      nullptr));
+}
+
+const char* ThumbnailLibrary::filename(int i) const {
+  // Offsets in a mapped copy are not checked when mapping it.
+  uint64_t offset = info_[i].filename_offset;
+  return offset < names_size_ ? names_ + offset : "";
+}
+
+bool ThumbnailLibrary::Write(const std::string& filename) const {
+  std::ofstream output(filename);
+  file::RecordWriter record_writer(&output,
+                                  file::RecordWriter::kDefaultBlockSize,
+                                  file::Compression::kZstd);
+  // Compress and write blocks while encoding the next ones.
+  record_writer.WriteInBackground(file::RecordWriter::kDefaultQueuedBlocks);
+  bool ok = true;
+  for (int i = 0; i < count_ && ok; ++i) {
+    ok = record_writer.WriteRecord(EncodePhotoRecord(
+        kThumbnailTag, this->filename(i), file_size(i), mtime(i),
+        pixels(i)));
+  }
+  for (size_t i = 0; i < skipped_.size() && ok; ++i) {
+    ok = WriteSkipped(&record_writer, skipped_[i]);
+  }
+  ok = ok && WritePq(&record_writer);
+  if (!record_writer.Close() || !ok) {
+    std::cerr << "Failed to write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// The records read from one range of a library file, with the thumbnails in
+// the same layout as the owned arrays.
+struct ThumbnailLibrary::ParsedRecords {
+  std::vector<uint8_t> pixels;
+  std::vector<PhotoInfo> info;
+  std::vector<char> names;
+  std::vector<SkippedPhoto> skipped;
+  std::string pq_record;
+
+  void AddThumbnail(const uint8_t* thumbnail_pixels, const char* filename,
+                    size_t filename_size, int64_t file_size, int64_t mtime) {
+    pixels.insert(pixels.end(), thumbnail_pixels,
+                  thumbnail_pixels + kThumbnailBytes);
+    PhotoInfo photo;
+    photo.filename_offset = names.size();
+    photo.file_size = file_size;
+    photo.mtime = mtime;
+    info.push_back(photo);
+    names.insert(names.end(), filename, filename + filename_size);
+    names.push_back('\0');
+  }
+};
+
+void ThumbnailLibrary::ParseRecord(const file::RecordView& record,
+                                   ParsedRecords* parsed) {
+  PhotoRecordHeader header;
+  if (ParsePhotoRecord(record, kThumbnailTag, kThumbnailBytes, &header)) {
+    const char* pixels = record.data + sizeof(header);
+    parsed->AddThumbnail(reinterpret_cast<const uint8_t*>(pixels),
+                         pixels + kThumbnailBytes, header.filename_size,
+                         header.file_size, header.mtime);
+  } else if (ParsePhotoRecord(record, kSkippedTag, 0, &header)) {
+    SkippedPhoto skipped;
+    skipped.filename.assign(record.data + sizeof(header),
+                            header.filename_size);
+    skipped.file_size = header.file_size;
+    skipped.mtime = header.mtime;
+    parsed->skipped.push_back(std::move(skipped));
+  } else if (record.size == sizeof(LegacyThumbnail) ||
+             record.size == kOldestThumbnailRecordBytes) {
+    LegacyThumbnail legacy;
+    memset(&legacy, 0, sizeof(legacy));
+    memcpy(&legacy, record.data, record.size);
+    parsed->AddThumbnail(legacy.pixels, legacy.filename,
+                         strnlen(legacy.filename, sizeof(legacy.filename)),
+                         legacy.file_size, legacy.mtime);
+  } else if (record.size == sizeof(LegacySkippedPhoto)) {
+    LegacySkippedPhoto legacy;
+    memcpy(&legacy, record.data, sizeof(legacy));
+    SkippedPhoto skipped;
+    skipped.filename.assign(
+        legacy.filename, strnlen(legacy.filename, sizeof(legacy.filename)));
+    skipped.file_size = legacy.file_size;
+    skipped.mtime = legacy.mtime;
+    parsed->skipped.push_back(std::move(skipped));
+  } else {
+    std::string other(record.data, record.size);
+    if (match::PqIndex::IsPqRecord(other)) {
+      parsed->pq_record.swap(other);
+    }
+  }
+}
+
+void ThumbnailLibrary::ReadRecords(const std::string& filename,
+                                   int64_t begin, int64_t end,
+                                   ParsedRecords* parsed) {
+  std::ifstream input(filename);
+  file::RecordReader record_reader(&input);
+  // Keep whatever can be read from a damaged library.
+  record_reader.SetSkipCorruptBlocks(true);
+  if (end >= 0) {
+    if (!record_reader.Seek(begin)) {
+      std::cerr << "Failed to seek to record " << begin << " of " << filename
+                << std::endl;
+      return;
+    }
+    record_reader.SetLimit(end);
+  }
+  file::RecordView record;
+  while (record_reader.ReadRecord(&record)) {
+    ParseRecord(record, parsed);
+  }
+  if (record_reader.corrupt_blocks() > 0) {
+    std::cerr << "Skipped " << record_reader.corrupt_blocks()
+              << " corrupt blocks in " << filename << std::endl;
+  }
+  record_reader.Close();
+}
+
+void ThumbnailLibrary::Read(const std::string& filename,
+                            util::ThreadPool* pool) {
+  filename_ = filename;
+  library_size_ = boost::filesystem::exists(filename)
+      ? boost::filesystem::file_size(filename) : 0;
+  ResetIndex();
+  mapped_.reset();
+  owned_pixels_.clear();
+  owned_info_.clear();
+  owned_names_.clear();
+  pq_record_.clear();
+  skipped_.clear();
+
+  // With an index, read one range of records per thread.
+  int64_t num_records;
+  {
+    std::ifstream input(filename);
+    file::RecordReader record_reader(&input);
+    num_records = record_reader.NumRecords();
+  }
+  int ranges = 1;
+  if (pool != nullptr && num_records > 0) {
+    ranges = std::min<int64_t>(pool->num_threads(), num_records);
+  }
+  std::vector<ParsedRecords> parsed(ranges);
+  if (ranges == 1) {
+    ReadRecords(filename, 0, num_records, &parsed[0]);
+  } else {
+    pool->ParallelFor(0, ranges, 1, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        ReadRecords(filename, num_records * i / ranges,
+                    num_records * (i + 1) / ranges, &parsed[i]);
+      }
+    });
+  }
+
+  if (ranges == 1) {
+    owned_pixels_.swap(parsed[0].pixels);
+    owned_info_.swap(parsed[0].info);
+    owned_names_.swap(parsed[0].names);
+    skipped_.swap(parsed[0].skipped);
+    pq_record_.swap(parsed[0].pq_record);
+  } else {
+    size_t thumbnails = 0;
+    size_t names_size = 0;
+    for (const ParsedRecords& records : parsed) {
+      thumbnails += records.info.size();
+      names_size += records.names.size();
+    }
+    owned_pixels_.reserve(thumbnails * kThumbnailBytes);
+    owned_info_.reserve(thumbnails);
+    owned_names_.reserve(names_size);
+    for (ParsedRecords& records : parsed) {
+      uint64_t names_offset = owned_names_.size();
+      owned_pixels_.insert(owned_pixels_.end(), records.pixels.begin(),
+                           records.pixels.end());
+      for (PhotoInfo info : records.info) {
+        info.filename_offset += names_offset;
+        owned_info_.push_back(info);
+      }
+      owned_names_.insert(owned_names_.end(), records.names.begin(),
+                          records.names.end());
+      skipped_.insert(skipped_.end(), records.skipped.begin(),
+                      records.skipped.end());
+      if (!records.pq_record.empty()) {
+        pq_record_.swap(records.pq_record);
+      }
+    }
+  }
+  UseOwned();
+
+  std::cout << "Loaded " << count_ << " thumbnails." << std::endl;
+  BuildIndex();
+}
+
+void ThumbnailLibrary::ReadMapped(const std::string& filename,
+                                  util::ThreadPool* pool) {
+  const std::string mapped_file = filename + ".map";
+  bool fresh = boost::filesystem::exists(mapped_file) &&
+      (!boost::filesystem::exists(filename) ||
+       boost::filesystem::last_write_time(mapped_file) >=
+       boost::filesystem::last_write_time(filename));
+  if (fresh && Map(filename, mapped_file)) {
+    return;
+  }
+  // The copy is missing, stale or in an older format.  Keep using the
+  // library as read if a new copy can not be written.
+  Read(filename, pool);
+  if (WriteMapped(mapped_file)) {
+    Map(filename, mapped_file);
+  }
+}
+
+bool ThumbnailLibrary::Map(const std::string& filename,
+                           const std::string& mapped_file) {
+  std::unique_ptr<file::MappedFile> mapped =
+      file::MappedFile::Open(mapped_file);
+  if (!mapped) {
+    return false;
+  }
+  MappedHeader header;
+  const uint64_t size = mapped->size();
+  bool valid = size >= sizeof(header);
+  if (valid) {
+    memcpy(&header, mapped->data(), sizeof(header));
+    // Check each section in turn, so that no bound can overflow.
+    valid = memcmp(header.magic, kMappedMagic, sizeof(kMappedMagic)) == 0 &&
+        header.thumbnail_bytes == kThumbnailBytes &&
+        header.count <= static_cast<uint64_t>(
+            std::numeric_limits<int>::max()) &&
+        header.pixels_offset <= size &&
+        header.count <= (size - header.pixels_offset) / kThumbnailBytes &&
+        header.info_offset % alignof(PhotoInfo) == 0 &&
+        header.info_offset <= size &&
+        header.count <= (size - header.info_offset) / sizeof(PhotoInfo) &&
+        header.names_offset <= size &&
+        header.names_bytes <= size - header.names_offset &&
+        (header.names_bytes == 0 ||
+         mapped->data()[header.names_offset + header.names_bytes - 1] ==
+         '\0') &&
+        header.pq_offset <= size &&
+        header.pq_bytes <= size - header.pq_offset &&
+        // Modification times only have a resolution of a second, so also
+        // check that the library was not rewritten to a different size.
+        (!boost::filesystem::exists(filename) ||
+         header.library_size == boost::filesystem::file_size(filename));
+  }
+  if (!valid) {
+    std::cerr << "Ignoring invalid or outdated mapped library "
+              << mapped_file << std::endl;
+    return false;
+  }
+
+  filename_ = filename;
+  ResetIndex();
+  owned_pixels_ = std::vector<uint8_t>();
+  owned_info_ = std::vector<PhotoInfo>();
+  owned_names_ = std::vector<char>();
+  pq_record_.clear();
+  skipped_.clear();
+  mapped_.swap(mapped);
+  pixels_ = reinterpret_cast<const uint8_t*>(
+      mapped_->data() + header.pixels_offset);
+  info_ = reinterpret_cast<const PhotoInfo*>(
+      mapped_->data() + header.info_offset);
+  names_ = mapped_->data() + header.names_offset;
+  names_size_ = header.names_bytes;
+  count_ = header.count;
+  library_size_ = header.library_size;
+
+  std::cout << "Mapped " << count_ << " thumbnails." << std::endl;
+  BuildIndex();
+  return true;
+}
+
+bool ThumbnailLibrary::WriteMapped(const std::string& filename) const {
+  std::string pq_record;
+  if (pq_ && pq_->trained()) {
+    pq_record = pq_->Serialize();
+  } else {
+    StoredPqRecord(&pq_record);
+  }
+
+  MappedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMappedMagic, sizeof(kMappedMagic));
+  header.thumbnail_bytes = kThumbnailBytes;
+  header.library_size = library_size_;
+  header.count = count_;
+  header.pixels_offset = kMappedPixelsOffset;
+  uint64_t pixels_end = header.pixels_offset +
+      static_cast<uint64_t>(count_) * kThumbnailBytes;
+  header.info_offset = (pixels_end + alignof(PhotoInfo) - 1) /
+      alignof(PhotoInfo) * alignof(PhotoInfo);
+  header.names_offset = header.info_offset +
+      static_cast<uint64_t>(count_) * sizeof(PhotoInfo);
+  header.names_bytes = names_size_;
+  header.pq_offset = header.names_offset + header.names_bytes;
+  header.pq_bytes = pq_record.size();
+  static_assert(sizeof(header) <= kMappedPixelsOffset,
+                "MappedHeader must fit before the pixels");
+
+  // Write to a temporary file, so that other processes never map a partly
+  // written copy.
+  const std::string temporary_file = filename + ".tmp";
+  std::ofstream output(temporary_file, std::ios::binary);
+  std::string padding(kMappedPixelsOffset - sizeof(header), '\0');
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  output.write(padding.data(), padding.size());
+  output.write(reinterpret_cast<const char*>(pixels_),
+               pixels_end - header.pixels_offset);
+  output.write(padding.data(), header.info_offset - pixels_end);
+  output.write(reinterpret_cast<const char*>(info_),
+               static_cast<std::streamsize>(count_) * sizeof(PhotoInfo));
+  output.write(names_, names_size_);
+  output.write(pq_record.data(), pq_record.size());
+  output.close();
+  boost::system::error_code error;
+  if (output.fail()) {
+    std::cerr << "Failed to write " << temporary_file << std::endl;
+    boost::filesystem::remove(temporary_file, error);
+    return false;
+  }
+  boost::filesystem::rename(temporary_file, filename, error);
+  if (error) {
+    std::cerr << "Failed to rename " << temporary_file << " to " << filename
+              << ": " << error.message() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ThumbnailLibrary::WritePq(file::RecordWriter* record_writer) const {
+  if (pq_ && pq_->trained()) {
+    return record_writer->WriteRecord(pq_->Serialize());
+  }
+  std::string pq_record;
+  if (StoredPqRecord(&pq_record)) {
+    return record_writer->WriteRecord(pq_record);
+  }
+  return true;
+}
+
+void ThumbnailLibrary::TrainPq(int subspaces) {
+  if (count_ == 0) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  pq_.reset(new match::PqIndex(pixels_, kThumbnailBytes, count_,
+                               kThumbnailBytes));
+  pq_->Train(subspaces);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "Trained " << pq_->subspaces() << " byte product quantization "
+            << "codes for " << count_ << " thumbnails in "
+            << elapsed.count() << "s, using "
+            << pq_->MemoryUsage() / (1024.0 * 1024.0) << " MiB." << std::endl;
+}
+
+void ThumbnailLibrary::SetMatchMode(MatchMode mode) {
+  mode_ = mode;
+  BuildIndex();
+}
+
+int ThumbnailLibrary::FindClosest(const uint8_t* pixels) const {
+  ++queries_;
+  uint64_t examined = 0;
+  int closest = Search(pixels, &examined);
+  bytes_examined_ += examined;
+  if (measure_recall_ && IsApproximate(mode_)) {
+    uint64_t unused = 0;
+    ++recall_queries_;
+    if (FindClosestExhaustive(pixels, &unused) == closest) {
+      ++recall_hits_;
+    }
+  }
+  return closest;
+}
+
+void ThumbnailLibrary::FindClosestBatch(const uint8_t* tiles, int n,
+                                        int* out) const {
+  // Indices and mean color ordering already avoid most of the library, so
+  // only the linear scans are blocked.
+  bool partial = mode_ == MatchMode::kPartial;
+  if (!(mode_ == MatchMode::kExhaustive || (partial && !mean_color_order_))) {
+    for (int t = 0; t < n; ++t) {
+      out[t] = FindClosest(tiles + t * kThumbnailBytes);
+    }
+    return;
+  }
+
+  queries_ += n;
+  uint64_t examined = 0;
+  const int count = count_;
+  std::vector<int> best_diff(kBatchTiles);
+  for (int tile_begin = 0; tile_begin < n; tile_begin += kBatchTiles) {
+    int tile_end = std::min(n, tile_begin + kBatchTiles);
+    for (int t = tile_begin; t < tile_end; ++t) {
+      out[t] = -1;
+      best_diff[t - tile_begin] = std::numeric_limits<int>::max();
+    }
+    // Thumbnails are visited in library order for every tile, so keeping the
+    // first strictly better match breaks ties like the unbatched scans.
+    for (int block_begin = 0; block_begin < count;
+         block_begin += kThumbnailBlock) {
+      int block_end = std::min(count, block_begin + kThumbnailBlock);
+      for (int t = tile_begin; t < tile_end; ++t) {
+        const uint8_t* tile = tiles + t * kThumbnailBytes;
+        int& tile_best_diff = best_diff[t - tile_begin];
+        for (int i = block_begin; i < block_end; ++i) {
+          int diff;
+          if (partial) {
+            diff = match::SsdBounded(tile, pixels(i),
+                                     kThumbnailBytes, kRowBytes,
+                                     tile_best_diff, &examined);
+          } else {
+            diff = match::Ssd(tile, pixels(i), kThumbnailBytes);
+          }
+          if (diff < tile_best_diff) {
+            tile_best_diff = diff;
+            out[t] = i;
+          }
+        }
+      }
+    }
+  }
+  if (!partial) {
+    examined = static_cast<uint64_t>(kThumbnailBytes) * count * n;
+  }
+  bytes_examined_ += examined;
+}
+
+double ThumbnailLibrary::AverageBytesExamined() const {
+  if (queries_ == 0) {
+    return 0.0;
+  }
+  return static_cast<double>(bytes_examined_) / queries_;
+}
+
+double ThumbnailLibrary::Recall() const {
+  if (recall_queries_ == 0) {
+    return -1.0;
+  }
+  return static_cast<double>(recall_hits_) / recall_queries_;
+}
+
+ThumbnailLibrary::ChannelSums ThumbnailLibrary::ComputeChannelSums(
+    const uint8_t* pixels) {
+  ChannelSums sums = {{0, 0, 0}};
+  for (int i = 0; i < kThumbnailBytes; ++i) {
+    sums.sum[i % 3] += pixels[i];
+  }
+  return sums;
+}
+
+void ThumbnailLibrary::ResetIndex() {
+  channel_sums_.clear();
+  brightness_order_.clear();
+  vptree_.reset();
+  pca_.reset();
+  pq_.reset();
+}
+
+void ThumbnailLibrary::UseOwned() {
+  pixels_ = owned_pixels_.data();
+  info_ = owned_info_.data();
+  names_ = owned_names_.data();
+  names_size_ = owned_names_.size();
+  count_ = owned_info_.size();
+}
+
+bool ThumbnailLibrary::StoredPqRecord(std::string* record) const {
+  if (mapped_) {
+    MappedHeader header;
+    memcpy(&header, mapped_->data(), sizeof(header));
+    record->assign(mapped_->data() + header.pq_offset, header.pq_bytes);
+  } else {
+    *record = pq_record_;
+  }
+  return !record->empty();
+}
+
+void ThumbnailLibrary::BuildIndex() {
+  if (count_ == 0) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (mode_ == MatchMode::kPartial && mean_color_order_ &&
+      channel_sums_.empty()) {
+    channel_sums_.reserve(count_);
+    brightness_order_.reserve(count_);
+    for (int i = 0; i < count_; ++i) {
+      const ChannelSums sums = ComputeChannelSums(pixels(i));
+      channel_sums_.push_back(sums);
+      brightness_order_.push_back(
+          std::make_pair(sums.sum[0] + sums.sum[1] + sums.sum[2], i));
+    }
+    std::sort(brightness_order_.begin(), brightness_order_.end());
+  }
+  if (mode_ == MatchMode::kVpTree && !vptree_) {
+    vptree_.reset(new match::VpTree(pixels_, kThumbnailBytes, count_,
+                                    kThumbnailBytes));
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Built VP-tree over " << count_
+              << " thumbnails in " << elapsed.count() << "s, using "
+              << vptree_->MemoryUsage() / (1024.0 * 1024.0) << " MiB."
+              << std::endl;
+  }
+  if (mode_ == MatchMode::kPca && !pca_) {
+    pca_.reset(new match::PcaIndex(pixels_, kThumbnailBytes, count_,
+                                   kThumbnailBytes));
+    // Reuse the stored projection, unless the library changed since.
+    const std::string pca_file = filename_ + ".pca";
+    bool loaded = !filename_.empty() &&
+        boost::filesystem::exists(pca_file) &&
+        boost::filesystem::last_write_time(pca_file) >=
+        boost::filesystem::last_write_time(filename_) &&
+        pca_->Read(pca_file, pca_dims_, library_size_);
+    if (!loaded) {
+      pca_->Train(pca_dims_);
+      if (!filename_.empty()) {
+        pca_->Write(pca_file, library_size_);
+      }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << (loaded ? "Loaded " : "Built ") << pca_->dims()
+              << " dimensional PCA index over " << count_
+              << " thumbnails in " << elapsed.count() << "s, using "
+              << pca_->MemoryUsage() / (1024.0 * 1024.0) << " MiB."
+              << std::endl;
+  }
+  if (mode_ == MatchMode::kPq && !pq_) {
+    std::string pq_record;
+    if (StoredPqRecord(&pq_record)) {
+      pq_.reset(new match::PqIndex(pixels_, kThumbnailBytes, count_,
+                                   kThumbnailBytes));
+      if (!pq_->Parse(pq_record)) {
+        std::cerr << "Ignoring product quantization codes that do not match "
+                  << "the library." << std::endl;
+        pq_.reset();
+      }
+    } else {
+      std::cout << "No product quantization codes in the library file."
+                << std::endl;
+    }
+    if (!pq_) {
+      TrainPq(pq_subspaces_);
+    }
+  }
+}
+
+int ThumbnailLibrary::Search(const uint8_t* pixels,
+                             uint64_t* examined) const {
+  if (mode_ == MatchMode::kVpTree && vptree_) {
+    return vptree_->FindClosest(pixels, examined);
+  }
+  if (mode_ == MatchMode::kPca && pca_) {
+    return pca_->FindClosest(pixels, pca_candidates_, examined);
+  }
+  if (mode_ == MatchMode::kPq && pq_) {
+    return pq_->FindClosest(pixels, pq_candidates_, examined);
+  }
+  if (mode_ == MatchMode::kPartial) {
+    if (mean_color_order_ && !channel_sums_.empty()) {
+      return FindClosestMeanColorOrder(pixels, examined);
+    }
+    return FindClosestPartial(pixels, examined);
+  }
+  return FindClosestExhaustive(pixels, examined);
+}
+
+int ThumbnailLibrary::FindClosestExhaustive(const uint8_t* pixels,
+                                            uint64_t* examined) const {
+  int best = -1;
+  int best_diff = std::numeric_limits<int>::max();
+  for (int i = 0; i < count_; ++i) {
+    int diff = match::Ssd(pixels, this->pixels(i), kThumbnailBytes);
+    if (diff < best_diff) {
+      best_diff = diff;
+      best = i;
+    }
+  }
+  *examined += static_cast<uint64_t>(kThumbnailBytes) * count_;
+  return best;
+}
+
+int ThumbnailLibrary::FindClosestPartial(const uint8_t* pixels,
+                                         uint64_t* examined) const {
+  int best = -1;
+  int best_diff = std::numeric_limits<int>::max();
+  for (int i = 0; i < count_; ++i) {
+    int diff = match::SsdBounded(pixels, this->pixels(i), kThumbnailBytes,
+                                 kRowBytes, best_diff, examined);
+    if (diff < best_diff) {
+      best_diff = diff;
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Each channel has 300 pixels, so by Cauchy-Schwarz the squared differences
+// of a channel add up to at least (sum of differences)^2 / 300.  This gives a
+// lower bound on the SSD from the channel sums alone, and by Cauchy-Schwarz
+// again, one of (difference of brightness)^2 / 900 from the sum of all
+// channels.  Thumbnails are visited outward from the tile's brightness, until
+// that rules out the thumbnails in both directions.
+int ThumbnailLibrary::FindClosestMeanColorOrder(const uint8_t* pixels,
+                                                uint64_t* examined) const {
+  const int kPixelsPerChannel = kThumbnailBytes / 3;
+  const ChannelSums query = ComputeChannelSums(pixels);
+  const int brightness = query.sum[0] + query.sum[1] + query.sum[2];
+  // Candidates below and at or above the tile's brightness.
+  size_t above = std::lower_bound(brightness_order_.begin(),
+                                  brightness_order_.end(),
+                                  std::make_pair(brightness, -1)) -
+      brightness_order_.begin();
+  size_t below = above;
+
+  int best = -1;
+  int best_diff = std::numeric_limits<int>::max();
+  while (below > 0 || above < brightness_order_.size()) {
+    const int64_t below_distance = below > 0
+        ? brightness - brightness_order_[below - 1].first
+        : std::numeric_limits<int>::max();
+    const int64_t above_distance = above < brightness_order_.size()
+        ? brightness_order_[above].first - brightness
+        : std::numeric_limits<int>::max();
+    const int64_t distance = std::min(below_distance, above_distance);
+    if (distance * distance > 3 * kPixelsPerChannel * int64_t{best_diff}) {
+      break;
+    }
+    const int i = below_distance < above_distance
+        ? brightness_order_[--below].second
+        : brightness_order_[above++].second;
+
+    int64_t bound = 0;
+    for (int c = 0; c < 3; ++c) {
+      int64_t d = query.sum[c] - channel_sums_[i].sum[c];
+      bound += d * d / kPixelsPerChannel;
+    }
+    if (bound > best_diff) {
+      continue;
+    }
+    int diff = match::SsdBounded(pixels, this->pixels(i), kThumbnailBytes,
+                                 kRowBytes, best_diff, examined);
+    // Candidates are not visited in library order, so break ties explicitly
+    // to match the exhaustive scan.
+    if (diff < best_diff || (diff == best_diff && i < best)) {
+      best_diff = diff;
+      best = i;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,292 @@
+// A library of small thumbnails of photos, and the search for the thumbnail
+// closest to a given tile of pixels.
+//
+// Thumbnails are 20x15 BGR images, compared by sum of squared differences
+// (see ssd.h).  The library is stored on disk as a RecordIO file with one
+// thumbnail record per photo, or a skipped photo record for photos that could
+// not be used, optionally followed by a record holding the product
+// quantization codes of the library (see pq_index.h).  Records are told apart
+// by a tag, or by their size for libraries written before filenames could be
+// longer than 255 characters.
+//
+// In memory, the pixels of all thumbnails are kept in one dense array, and
+// the filenames in a separate table of NUL terminated strings, so searches
+// stream through nothing but pixels.  For fast startup the library can also
+// be loaded from a memory mapped copy in the same layout, stored next to the
+// library file with a .map suffix.  It holds a fixed header, the pixel
+// array, the file sizes, modification times and filename offsets, the
+// filename table, and then the product quantization record, so searches run
+// directly on the mapped pages.
+
+#ifndef INFINIPIC_THUMBNAIL_LIBRARY_H_
+#define INFINIPIC_THUMBNAIL_LIBRARY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace file {
+class MappedFile;
+class RecordWriter;
+struct RecordView;
+}  // namespace file
+
+namespace match {
+class PcaIndex;
+class PqIndex;
+class VpTree;
+}  // namespace match
+
+namespace util {
+class ThreadPool;
+}  // namespace util
+
+// A photo and its thumbnail.  The file size and modification time of the
+// photo are stored so that thumbnails can be regenerated only for photos that
+// changed.  Older libraries lack them, in which case they are zero.
+struct Thumbnail {
+  static const int kWidth = 20;
+  static const int kHeight = 15;
+
+  std::string filename;
+  uint8_t pixels[3 * kWidth * kHeight];
+  int64_t file_size;
+  int64_t mtime;
+};
+
+// A photo that was unreadable or did not have a 4:3 aspect ratio, so it is
+// not looked at again until it changes.
+struct SkippedPhoto {
+  std::string filename;
+  int64_t file_size;
+  int64_t mtime;
+};
+
+// How FindClosest searches the library.  Unless noted otherwise, a mode
+// returns exactly the same match as kExhaustive, ties going to the thumbnail
+// that was added first.
+enum class MatchMode {
+  // Compare the tile against every thumbnail in full.
+  kExhaustive,
+  // Compare one thumbnail row at a time, abandoning a thumbnail as soon as
+  // its running sum exceeds the best match so far.
+  kPartial,
+  // Search a vantage point tree, built once when the library is read.
+  kVpTree,
+  // Approximate: pick candidates by distance between PCA projections, and
+  // return the closest candidate by SSD.  The projection is stored next to
+  // the library file, with a .pca suffix.
+  kPca,
+  // Approximate: pick candidates by product quantized distance, and return
+  // the closest candidate by SSD.  Uses the codes stored in the library file
+  // if there are any.
+  kPq,
+};
+
+// Parse a --match_mode value, returning false if it is unknown.
+bool ParseMatchMode(const std::string& name, MatchMode* mode);
+
+// Once the match mode is set, FindClosest and FindClosestBatch may be called
+// from several threads at once.
+class ThumbnailLibrary {
+ public:
+  ThumbnailLibrary();
+  ~ThumbnailLibrary();
+
+  void Add(const Thumbnail& thumbnail);
+
+  void AddSkipped(const SkippedPhoto& skipped);
+
+  // Append a thumbnail or skipped photo record, for writing a library file
+  // one photo at a time.
+  static bool WriteThumbnail(file::RecordWriter* record_writer,
+                             const Thumbnail& thumbnail);
+  static bool WriteSkipped(file::RecordWriter* record_writer,
+                           const SkippedPhoto& skipped);
+
+  int size() const { return count_; }
+  const uint8_t* pixels(int i) const {
+    return pixels_ + i * sizeof(Thumbnail::pixels);
+  }
+  const char* filename(int i) const;
+  int64_t file_size(int i) const { return info_[i].file_size; }
+  int64_t mtime(int i) const { return info_[i].mtime; }
+  const std::vector<SkippedPhoto>& skipped() const { return skipped_; }
+
+  // Write a library file, returning false if it could not be written.
+  bool Write(const std::string& filename) const;
+
+  // Read a library file.  If pool is not null and the file has a RecordIO
+  // index, ranges of the file are read and parsed in parallel.
+  void Read(const std::string& filename, util::ThreadPool* pool);
+
+  // Map the memory mapped copy of the library file, taking constant time.  If
+  // the copy is missing, older than the library file, or was copied from a
+  // library file of another size, Read the library and write a new copy
+  // first.  Skipped photos are not kept in the copy.
+  void ReadMapped(const std::string& filename, util::ThreadPool* pool);
+
+  // Write the memory mapped copy of the library to the given file.
+  bool WriteMapped(const std::string& filename) const;
+
+  // Learn product quantization codebooks with the given number of subspaces
+  // (bytes per thumbnail) and encode the library, to be stored by Write.
+  void TrainPq(int subspaces);
+
+  // Write the product quantization record, if TrainPq was called or the
+  // library file had one, for appending to a library file written elsewhere.
+  bool WritePq(file::RecordWriter* record_writer) const;
+
+  // Set the search used by FindClosest, building any index it needs.
+  void SetMatchMode(MatchMode mode);
+
+  // In kPartial mode, visit thumbnails ordered by how close their mean
+  // brightness is to the tile's, rather than in library order, skipping those
+  // whose mean color alone rules them out.  This finds a tight bound early,
+  // and lets the search stop once the brightness alone rules out every
+  // remaining thumbnail.  The library is sorted by brightness once, when the
+  // mode is selected, which must be after this is set.
+  void SetMeanColorOrder(bool mean_color_order) {
+    mean_color_order_ = mean_color_order;
+  }
+
+  // In kPca mode, project to dims dimensions and re-rank the given number of
+  // candidates.  The dimensions must be set before selecting the mode.
+  void SetPcaOptions(int dims, int candidates) {
+    pca_dims_ = dims;
+    pca_candidates_ = candidates;
+  }
+
+  // In kPq mode, the number of candidates to re-rank, and the subspaces to
+  // train with if the library file has no codes.
+  void SetPqOptions(int subspaces, int candidates) {
+    pq_subspaces_ = subspaces;
+    pq_candidates_ = candidates;
+  }
+
+  // For approximate match modes, also run an exhaustive scan for every query,
+  // to measure how often the approximate match is the true closest one.
+  void SetMeasureRecall(bool measure_recall) {
+    measure_recall_ = measure_recall;
+  }
+
+  // Return the index of the thumbnail closest to the given 20x15 BGR pixels,
+  // or -1 if the library is empty.
+  int FindClosest(const uint8_t* pixels) const;
+
+  // Find the closest thumbnail to each of n tiles stored one after another
+  // in tiles, storing them in out[0, n).  The results are the same as calling
+  // FindClosest on every tile, but linear scans are blocked over both tiles
+  // and thumbnails, so each block of thumbnails is loaded into cache once
+  // per block of kBatchTiles tiles rather than once per tile.  Callers that
+  // split tiles over threads should pass multiples of kBatchTiles, so no
+  // block is cut short.
+  void FindClosestBatch(const uint8_t* tiles, int n, int* out) const;
+  static const int kBatchTiles = 128;
+
+  // Average number of pixel bytes compared per call of FindClosest, not
+  // counting scans for measuring recall.
+  double AverageBytesExamined() const;
+
+  // Fraction of queries where the approximate match was the true closest
+  // thumbnail, or -1 if recall was not measured.
+  double Recall() const;
+
+ private:
+  // Everything about a thumbnail but its pixels.
+  struct PhotoInfo {
+    uint64_t filename_offset;
+    int64_t file_size;
+    int64_t mtime;
+  };
+
+  // Records parsed by ReadRecords.
+  struct ParsedRecords;
+
+  // Per channel sums of pixel values, for the mean color lower bound.
+  struct ChannelSums {
+    int sum[3];
+  };
+
+  static ChannelSums ComputeChannelSums(const uint8_t* pixels);
+
+  // Build the index needed by the current match mode, if not already built.
+  void BuildIndex();
+
+  // Read records [begin, end) of a library file, or all of it if end is
+  // negative, which needs no RecordIO index.
+  static void ReadRecords(const std::string& filename, int64_t begin,
+                          int64_t end, ParsedRecords* parsed);
+  static void ParseRecord(const file::RecordView& record,
+                          ParsedRecords* parsed);
+
+  // Drop the indices, which point into the thumbnails.
+  void ResetIndex();
+
+  // Point the thumbnails at the owned arrays, after they changed.
+  void UseOwned();
+
+  // Map a copy written by WriteMapped, returning false if it is missing or
+  // invalid, in which case the library is left as it was.
+  bool Map(const std::string& filename, const std::string& mapped_file);
+
+  // Get the stored product quantization record, returning false if the
+  // library file had none.
+  bool StoredPqRecord(std::string* record) const;
+
+  // Each search adds the number of pixel bytes it compared to *examined.
+  int Search(const uint8_t* pixels, uint64_t* examined) const;
+  int FindClosestExhaustive(const uint8_t* pixels, uint64_t* examined) const;
+  int FindClosestPartial(const uint8_t* pixels, uint64_t* examined) const;
+  int FindClosestMeanColorOrder(const uint8_t* pixels,
+                                uint64_t* examined) const;
+
+  // The file the library was read from, used to find stored indices.
+  std::string filename_;
+
+  // The thumbnails searched, either in the owned arrays below or in the
+  // mapped copy.
+  const uint8_t* pixels_;
+  const PhotoInfo* info_;
+  const char* names_;
+  uint64_t names_size_;
+  int count_;
+  // Size of filename_ when it was read, to tell whether stored indices are
+  // still for the same library.
+  uint64_t library_size_;
+
+  std::vector<uint8_t> owned_pixels_;
+  std::vector<PhotoInfo> owned_info_;
+  std::vector<char> owned_names_;
+  std::unique_ptr<file::MappedFile> mapped_;
+  // Product quantization record read from the library file, parsed when
+  // first needed.  For a mapped library it stays in the mapped copy.
+  std::string pq_record_;
+  std::vector<SkippedPhoto> skipped_;
+  std::vector<ChannelSums> channel_sums_;
+  // The sum of all channel sums and the index of every thumbnail, sorted.
+  std::vector<std::pair<int, int>> brightness_order_;
+  std::unique_ptr<match::VpTree> vptree_;
+  std::unique_ptr<match::PcaIndex> pca_;
+  std::unique_ptr<match::PqIndex> pq_;
+
+  MatchMode mode_;
+  bool mean_color_order_;
+  int pca_dims_;
+  int pca_candidates_;
+  int pq_subspaces_;
+  int pq_candidates_;
+  bool measure_recall_;
+
+  // Search statistics, for AverageBytesExamined and Recall.  Searches may
+  // run on several threads at once.
+  mutable std::atomic<uint64_t> queries_;
+  mutable std::atomic<uint64_t> bytes_examined_;
+  mutable std::atomic<uint64_t> recall_queries_;
+  mutable std::atomic<uint64_t> recall_hits_;
+};
+
+#endif  // INFINIPIC_THUMBNAIL_LIBRARY_H_
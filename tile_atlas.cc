@@ -0,0 +1,183 @@
+#include "tile_atlas.h"
+
+#include <algorithm>
+
+#include <GL/gl.h>
+
+namespace graphics {
+namespace {
+
+// Textures of this size are supported everywhere that matters, and hold
+// thousands of thumbnails.
+const int kMaxPageSize = 2048;
+
+}  // namespace
+
+TileQuads::~TileQuads() {
+  Clear();
+}
+
+void TileQuads::Add(const uint8_t* pixels, float x, float y, float width,
+                    float height) {
+  Quad quad = {atlas_->AddTile(pixels), x, y, width, height};
+  quads_.push_back(quad);
+  changed_ = true;
+}
+
+void TileQuads::Clear() {
+  for (const Quad& quad : quads_) {
+    atlas_->ReleaseTile(quad.tile);
+  }
+  quads_.clear();
+  changed_ = true;
+}
+
+TileAtlas::TileAtlas(int tile_width, int tile_height)
+    : tile_width_(tile_width),
+      tile_height_(tile_height),
+      page_size_(0),
+      columns_(0),
+      rows_(0) {
+}
+
+TileAtlas::~TileAtlas() {
+  if (!textures_.empty()) {
+    glDeleteTextures(textures_.size(), textures_.data());
+  }
+}
+
+int TileAtlas::AddTile(const uint8_t* pixels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = tile_numbers_.find(pixels);
+  if (found != tile_numbers_.end()) {
+    ++cells_[found->second].references;
+    return found->second;
+  }
+  int tile;
+  if (free_cells_.empty()) {
+    tile = cells_.size();
+    cells_.push_back(Cell());
+  } else {
+    tile = free_cells_.back();
+    free_cells_.pop_back();
+  }
+  cells_[tile].pixels = pixels;
+  cells_[tile].references = 1;
+  tile_numbers_[pixels] = tile;
+  pending_.push_back(tile);
+  return tile;
+}
+
+void TileAtlas::ReleaseTile(int tile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Cell& cell = cells_[tile];
+  if (--cell.references == 0) {
+    tile_numbers_.erase(cell.pixels);
+    cell.pixels = nullptr;
+    free_cells_.push_back(tile);
+  }
+}
+
+void TileAtlas::Draw(TileQuads* quads) {
+  Upload();
+  if (quads->changed_) {
+    BuildVertices(quads);
+    quads->changed_ = false;
+  }
+
+  glEnable(GL_TEXTURE_2D);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  for (size_t page = 0; page < quads->pages_.size(); ++page) {
+    const TileQuads::PageVertices& vertices = quads->pages_[page];
+    if (vertices.vertices.empty()) {
+      continue;
+    }
+    glBindTexture(GL_TEXTURE_2D, textures_[page]);
+    glVertexPointer(2, GL_FLOAT, 0, vertices.vertices.data());
+    glTexCoordPointer(2, GL_FLOAT, 0, vertices.texture_coordinates.data());
+    glDrawArrays(GL_QUADS, 0, vertices.vertices.size() / 2);
+  }
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisable(GL_TEXTURE_2D);
+}
+
+void TileAtlas::Upload() {
+  if (page_size_ == 0) {
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    page_size_ = std::min<int>(std::max<int>(max_size, 64), kMaxPageSize);
+    columns_ = std::max(page_size_ / tile_width_, 1);
+    rows_ = std::max(page_size_ / tile_height_, 1);
+  }
+  // Upload with the lock held, as cells may be freed and reused meanwhile.
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pending_.empty()) {
+    return;
+  }
+
+  const size_t tiles_per_page = columns_ * rows_;
+  while (textures_.size() * tiles_per_page < cells_.size()) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    // Tiles are drawn at about their own size or larger, and nearest
+    // sampling never reads from neighbouring cells.
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, page_size_, page_size_, 0,
+                 GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+    textures_.push_back(texture);
+  }
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int tile : pending_) {
+    // The cell may have been freed again before its upload.
+    const uint8_t* pixels = cells_[tile].pixels;
+    if (pixels == nullptr) {
+      continue;
+    }
+    int cell = tile % tiles_per_page;
+    glBindTexture(GL_TEXTURE_2D, textures_[tile / tiles_per_page]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (cell % columns_) * tile_width_,
+                    (cell / columns_) * tile_height_, tile_width_,
+                    tile_height_, GL_BGR, GL_UNSIGNED_BYTE, pixels);
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  pending_.clear();
+}
+
+void TileAtlas::BuildVertices(TileQuads* quads) const {
+  quads->pages_.resize(textures_.size());
+  for (TileQuads::PageVertices& page : quads->pages_) {
+    page.vertices.clear();
+    page.texture_coordinates.clear();
+  }
+  const int tiles_per_page = columns_ * rows_;
+  const float cell_width = static_cast<float>(tile_width_) / page_size_;
+  const float cell_height = static_cast<float>(tile_height_) / page_size_;
+  for (const TileQuads::Quad& quad : quads->quads_) {
+    TileQuads::PageVertices& page = quads->pages_[quad.tile / tiles_per_page];
+    int cell = quad.tile % tiles_per_page;
+    float s = (cell % columns_) * cell_width;
+    float t = (cell / columns_) * cell_height;
+    const float vertices[] = {
+        quad.x, quad.y,
+        quad.x + quad.width, quad.y,
+        quad.x + quad.width, quad.y + quad.height,
+        quad.x, quad.y + quad.height};
+    const float texture_coordinates[] = {
+        s, t,
+        s + cell_width, t,
+        s + cell_width, t + cell_height,
+        s, t + cell_height};
+    page.vertices.insert(page.vertices.end(), vertices, vertices + 8);
+    page.texture_coordinates.insert(page.texture_coordinates.end(),
+                                    texture_coordinates,
+                                    texture_coordinates + 8);
+  }
+}
+
+}  // namespace graphics
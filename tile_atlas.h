@@ -0,0 +1,134 @@
+// Drawing many small images, such as the tiles of a mosaic, with few OpenGL
+// calls.
+//
+// Every distinct image is uploaded once into a texture atlas, a large texture
+// holding a grid of equally sized cells, split over several textures if it
+// does not fit in one.  Each frame then draws a set of quads with one vertex
+// array call per texture, instead of sending every image with glDrawPixels.
+// Several sets of quads, for example one per mosaic, can share an atlas.
+//
+// Tiles are reference counted by the quads drawing them, and their cells are
+// reused for new tiles once no quads use them, so the atlas only grows to the
+// number of distinct tiles in use at once.
+//
+// Images are only uploaded by Draw, so quads can be added before there is an
+// OpenGL context, and also on other threads.
+//
+// Example:
+//   graphics::TileAtlas atlas(20, 15);
+//   graphics::TileQuads quads(&atlas);
+//   quads.Add(pixels, x, y, 10, 7.5);
+//   ...
+//   atlas.Draw(&quads);
+
+#ifndef INFINIPIC_TILE_ATLAS_H_
+#define INFINIPIC_TILE_ATLAS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace graphics {
+
+class TileAtlas;
+
+// A set of quads drawn from a TileAtlas, which must outlive it.
+class TileQuads {
+ public:
+  explicit TileQuads(TileAtlas* atlas) : atlas_(atlas), changed_(false) {}
+
+  // Releases the tiles.
+  ~TileQuads();
+
+  // Draw the tile with the given pixels in the rectangle from (x, y) to
+  // (x + width, y + height).  Tiles are identified by their pixels pointer,
+  // so adding the same pixels again uses the same tile, and the pixels must
+  // stay valid until the next Draw.
+  void Add(const uint8_t* pixels, float x, float y, float width,
+           float height);
+
+  void Clear();
+
+ private:
+  friend class TileAtlas;
+
+  struct Quad {
+    int tile;
+    float x, y, width, height;
+  };
+
+  // The quads drawn from one texture of the atlas, with two coordinates for
+  // each corner.
+  struct PageVertices {
+    std::vector<float> vertices;
+    std::vector<float> texture_coordinates;
+  };
+
+  TileAtlas* const atlas_;
+  std::vector<Quad> quads_;
+  // True if quads were added or cleared since the vertices were built.
+  bool changed_;
+  std::vector<PageVertices> pages_;
+};
+
+class TileAtlas {
+ public:
+  // Tiles are tile_width by tile_height BGR images, with the bottom row
+  // first as for glDrawPixels.
+  TileAtlas(int tile_width, int tile_height);
+
+  // Deletes the textures, so the OpenGL context must still be current if
+  // anything was drawn.
+  ~TileAtlas();
+
+  // Upload any new tiles, and draw the quads, which must be of this atlas.
+  void Draw(TileQuads* quads);
+
+ private:
+  friend class TileQuads;
+
+  // A cell of the atlas, free if it has no references.
+  struct Cell {
+    const uint8_t* pixels;
+    int references;
+  };
+
+  // Add a reference to the tile with the given pixels, placing it in a cell
+  // if it has none, and return its cell number.  May be called from any
+  // thread.
+  int AddTile(const uint8_t* pixels);
+
+  // Drop a reference to the tile in the given cell, freeing the cell once
+  // there are none left.  May be called from any thread.
+  void ReleaseTile(int tile);
+
+  // Create any textures needed, and upload the tiles placed in cells since
+  // the last call.
+  void Upload();
+
+  // Sort the quads into the vertex arrays of the pages holding their tiles.
+  void BuildVertices(TileQuads* quads) const;
+
+  const int tile_width_;
+  const int tile_height_;
+  // Size of the square textures, and the number of cells across and down
+  // them.  Zero until the first Draw.
+  int page_size_;
+  int columns_;
+  int rows_;
+
+  // Guards the cells, which may be changed on other threads.
+  std::mutex mutex_;
+  std::vector<Cell> cells_;
+  std::unordered_map<const uint8_t*, int> tile_numbers_;
+  std::vector<int> free_cells_;
+  // Cells whose tiles are not uploaded yet.
+  std::vector<int> pending_;
+  std::vector<unsigned int> textures_;
+};
+
+}  // namespace graphics
+
+#endif  // INFINIPIC_TILE_ATLAS_H_
@@ -0,0 +1,138 @@
+#include "tile_sampler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+namespace image {
+
+TileSampler::TileSampler(int tile_width, int tile_height, int width,
+                         int height)
+    : width_(width), height_(height), kernel_(SampleGenericKernel) {
+  for (int x = 0; x < width; ++x) {
+    x_begin_.push_back(x * tile_width / width);
+    x_end_.push_back(std::max((x + 1) * tile_width / width,
+                              x_begin_.back() + 1));
+  }
+  for (int y = 0; y < height; ++y) {
+    y_begin_.push_back(y * tile_height / height);
+    y_end_.push_back(std::max((y + 1) * tile_height / height,
+                              y_begin_.back() + 1));
+  }
+
+  if (tile_width % width == 0 && tile_height % height == 0 &&
+      tile_width / width == tile_height / height) {
+    switch (tile_width / width) {
+      case 1:
+        kernel_ = SampleScaled<1, 1>;
+        break;
+      case 2:
+        kernel_ = SampleScaled<2, 2>;
+        break;
+      case 3:
+        kernel_ = SampleScaled<3, 3>;
+        break;
+      case 4:
+        kernel_ = SampleScaled<4, 4>;
+        break;
+    }
+  }
+}
+
+void TileSampler::SampleGeneric(const uint8_t* tile, size_t stride,
+                                uint8_t* out) const {
+  SampleGenericKernel(*this, tile, stride, out);
+}
+
+bool TileSampler::specialized() const {
+  return kernel_ != SampleGenericKernel;
+}
+
+template <int kScaleX, int kScaleY>
+void TileSampler::SampleScaled(const TileSampler& sampler,
+                               const uint8_t* tile, size_t stride,
+                               uint8_t* out) {
+  const int width = sampler.width_;
+  for (int y = 0; y < sampler.height_; ++y) {
+    const uint8_t* row = tile + y * kScaleY * stride;
+    if (kScaleX == 1 && kScaleY == 1) {
+      memcpy(out, row, 3 * width);
+      out += 3 * width;
+      continue;
+    }
+    for (int x = 0; x < width; ++x) {
+      for (int channel = 0; channel < 3; ++channel) {
+        int sum = 0;
+        for (int dy = 0; dy < kScaleY; ++dy) {
+          const uint8_t* block = row + dy * stride + 3 * kScaleX * x + channel;
+          for (int dx = 0; dx < kScaleX; ++dx) {
+            sum += block[3 * dx];
+          }
+        }
+        // The divisor is a constant, so this compiles to a multiply.
+        *out++ = (sum + kScaleX * kScaleY / 2) / (kScaleX * kScaleY);
+      }
+    }
+  }
+}
+
+void TileSampler::SampleGenericKernel(const TileSampler& sampler,
+                                      const uint8_t* tile, size_t stride,
+                                      uint8_t* out) {
+  for (int y = 0; y < sampler.height_; ++y) {
+    const int y_begin = sampler.y_begin_[y];
+    const int y_end = sampler.y_end_[y];
+    for (int x = 0; x < sampler.width_; ++x) {
+      const int x_begin = sampler.x_begin_[x];
+      const int x_end = sampler.x_end_[x];
+      const int count = (x_end - x_begin) * (y_end - y_begin);
+      for (int channel = 0; channel < 3; ++channel) {
+        int sum = 0;
+        for (int tile_y = y_begin; tile_y < y_end; ++tile_y) {
+          const uint8_t* row = tile + tile_y * stride + channel;
+          for (int tile_x = x_begin; tile_x < x_end; ++tile_x) {
+            sum += row[3 * tile_x];
+          }
+        }
+        *out++ = (sum + count / 2) / count;
+      }
+    }
+  }
+}
+
+bool VerifyTileSamplers(int width, int height) {
+  std::mt19937 rng(17);
+  std::uniform_int_distribution<int> byte(0, 255);
+  bool ok = true;
+  for (int scale = 1; scale <= 4; ++scale) {
+    const int tile_width = scale * width;
+    const int tile_height = scale * height;
+    TileSampler sampler(tile_width, tile_height, width, height);
+    if (!sampler.specialized()) {
+      std::cerr << "No specialized tile sampler for " << tile_width << "x"
+                << tile_height << " tiles" << std::endl;
+      ok = false;
+    }
+    // Rows padded as in a wider image.
+    const size_t stride = 3 * tile_width + 7;
+    std::vector<uint8_t> tile(stride * tile_height);
+    std::vector<uint8_t> expected(3 * width * height);
+    std::vector<uint8_t> actual(3 * width * height);
+    for (int trial = 0; trial < 3; ++trial) {
+      for (uint8_t& value : tile) {
+        value = trial == 0 ? byte(rng) : trial == 1 ? 255 : 0;
+      }
+      sampler.SampleGeneric(tile.data(), stride, expected.data());
+      sampler.Sample(tile.data(), stride, actual.data());
+      if (expected != actual) {
+        std::cerr << "Tile sampler mismatch for " << tile_width << "x"
+                  << tile_height << " tiles, trial " << trial << std::endl;
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+}  // namespace image
@@ -0,0 +1,73 @@
+// Reducing the tiles of a mosaic to the size of a thumbnail, so they can be
+// matched against the thumbnail library.
+//
+// Every thumbnail pixel is the rounded average of the block of tile pixels it
+// covers, or the nearest tile pixel if tiles are smaller than thumbnails.
+// Tiles that are 1 to 4 times the thumbnail size in both directions, which
+// covers the common mosaic layouts, are reduced by kernels specialized at
+// compile time for their fixed block size.  Other sizes use a generic kernel
+// that looks up the block of every pixel in tables.  All kernels give the
+// same result.
+//
+// Example:
+//   image::TileSampler sampler(40, 30, 20, 15);
+//   sampler.Sample(image.ptr<uint8_t>(30 * r) + 3 * 40 * c, image.step,
+//                  thumbnail);
+
+#ifndef INFINIPIC_TILE_SAMPLER_H_
+#define INFINIPIC_TILE_SAMPLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace image {
+
+class TileSampler {
+ public:
+  // Tiles are tile_width by tile_height BGR pixels, reduced to width by
+  // height.
+  TileSampler(int tile_width, int tile_height, int width, int height);
+
+  // Reduce the tile whose first row starts at tile, with rows stride bytes
+  // apart, into the width by height pixels at out.
+  void Sample(const uint8_t* tile, size_t stride, uint8_t* out) const {
+    kernel_(*this, tile, stride, out);
+  }
+
+  // The generic kernel, for checking the specialized ones against.
+  void SampleGeneric(const uint8_t* tile, size_t stride, uint8_t* out) const;
+
+  // True if Sample uses a specialized kernel.
+  bool specialized() const;
+
+ private:
+  typedef void (*Kernel)(const TileSampler& sampler, const uint8_t* tile,
+                         size_t stride, uint8_t* out);
+
+  template <int kScaleX, int kScaleY>
+  static void SampleScaled(const TileSampler& sampler, const uint8_t* tile,
+                           size_t stride, uint8_t* out);
+  static void SampleGenericKernel(const TileSampler& sampler,
+                                  const uint8_t* tile, size_t stride,
+                                  uint8_t* out);
+
+  const int width_;
+  const int height_;
+  // The tile columns [x_begin_[x], x_end_[x]) and rows [y_begin_[y],
+  // y_end_[y]) averaged into output pixel (x, y).
+  std::vector<int> x_begin_;
+  std::vector<int> x_end_;
+  std::vector<int> y_begin_;
+  std::vector<int> y_end_;
+  Kernel kernel_;
+};
+
+// Check that the specialized kernel for every supported scale is used and
+// bit-exact with the generic one, reducing tiles of random data and extreme
+// values to width by height.  Mismatches are reported on stderr.
+bool VerifyTileSamplers(int width, int height);
+
+}  // namespace image
+
+#endif  // INFINIPIC_TILE_SAMPLER_H_
@@ -0,0 +1,153 @@
+#include "vptree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "ssd.h"
+
+namespace match {
+namespace {
+
+// Subtrees with at most this many points are scanned linearly.
+const int kLeafSize = 8;
+
+// Bytes compared between checks of the running sum when scanning leaves.
+const int kBlockBytes = 64;
+
+// Distances are computed in floating point from exact integer SSDs, allow a
+// little slack so that rounding never prunes a tied match.
+const double kSlack = 1e-6;
+
+}  // namespace
+
+struct VpTree::BuildState {
+  std::mt19937 rng;
+  std::vector<double> distances;
+};
+
+struct VpTree::Query {
+  const uint8_t* pixels;
+  uint64_t* examined;
+  int best;
+  int best_diff;
+  // Euclidean distance of the best match, plus slack.
+  double tau;
+
+  void Update(int i, int diff) {
+    if (diff < best_diff || (diff == best_diff && i < best)) {
+      best = i;
+      best_diff = diff;
+      tau = std::sqrt(static_cast<double>(diff)) + kSlack;
+    }
+  }
+};
+
+VpTree::VpTree(const uint8_t* base, size_t stride, int count, int dims)
+    : base_(base),
+      stride_(stride),
+      dims_(dims),
+      order_(count) {
+  for (int i = 0; i < count; ++i) {
+    order_[i] = i;
+  }
+  BuildState state;
+  state.distances.resize(count);
+  if (count > 0) {
+    Build(0, count, &state);
+  }
+}
+
+int VpTree::FindClosest(const uint8_t* query, uint64_t* examined) const {
+  Query q;
+  q.pixels = query;
+  q.examined = examined;
+  q.best = -1;
+  q.best_diff = std::numeric_limits<int>::max();
+  q.tau = std::numeric_limits<double>::infinity();
+  if (!nodes_.empty()) {
+    Search(0, &q);
+  }
+  return q.best;
+}
+
+size_t VpTree::MemoryUsage() const {
+  return order_.capacity() * sizeof(order_[0]) +
+      nodes_.capacity() * sizeof(nodes_[0]);
+}
+
+int VpTree::Build(int begin, int end, BuildState* state) {
+  int n = nodes_.size();
+  nodes_.push_back(Node());
+  nodes_[n].begin = begin;
+  nodes_[n].end = end;
+  nodes_[n].radius = 0.0;
+  nodes_[n].inside = -1;
+  nodes_[n].outside = -1;
+  if (end - begin <= kLeafSize) {
+    return n;
+  }
+
+  // Move a random vantage point to the front, and split the rest at their
+  // median distance from it.
+  std::uniform_int_distribution<int> pick(begin, end - 1);
+  std::swap(order_[begin], order_[pick(state->rng)]);
+  const uint8_t* vantage_point = point(order_[begin]);
+  std::vector<double>& distances = state->distances;
+  for (int i = begin + 1; i < end; ++i) {
+    distances[order_[i]] =
+        std::sqrt(static_cast<double>(Ssd(vantage_point, point(order_[i]),
+                                          dims_)));
+  }
+  int middle = begin + 1 + (end - begin - 1) / 2;
+  std::nth_element(order_.begin() + begin + 1, order_.begin() + middle,
+                   order_.begin() + end,
+                   [&distances](int a, int b) {
+                     return distances[a] < distances[b];
+                   });
+  double radius = distances[order_[middle]];
+
+  // Children may reallocate nodes_, so don't hold references across Build.
+  int inside = Build(begin + 1, middle, state);
+  int outside = Build(middle, end, state);
+  nodes_[n].radius = radius;
+  nodes_[n].inside = inside;
+  nodes_[n].outside = outside;
+  return n;
+}
+
+void VpTree::Search(int n, Query* q) const {
+  const Node& node = nodes_[n];
+  if (node.inside < 0) {
+    for (int i = node.begin; i < node.end; ++i) {
+      int diff = SsdBounded(q->pixels, point(order_[i]), dims_, kBlockBytes,
+                            q->best_diff, q->examined);
+      q->Update(order_[i], diff);
+    }
+    return;
+  }
+
+  int vantage_point = order_[node.begin];
+  int diff = Ssd(q->pixels, point(vantage_point), dims_);
+  *q->examined += dims_;
+  q->Update(vantage_point, diff);
+
+  // By the triangle inequality, points inside are at least d - radius from
+  // the query, and points outside at least radius - d.  Search the side the
+  // query falls in first, since it most likely holds the best match.
+  double d = std::sqrt(static_cast<double>(diff));
+  if (d <= node.radius) {
+    Search(node.inside, q);
+    if (node.radius - d <= q->tau) {
+      Search(node.outside, q);
+    }
+  } else {
+    Search(node.outside, q);
+    if (d - node.radius <= q->tau) {
+      Search(node.inside, q);
+    }
+  }
+}
+
+}  // namespace match
@@ -0,0 +1,63 @@
+// A vantage point tree for exact nearest neighbour search over byte vectors,
+// under the euclidean distance (the square root of the SSD from ssd.h).
+//
+// Each node picks a vantage point and splits the remaining points at their
+// median distance from it.  A query can skip a whole side of a node whenever
+// the triangle inequality shows it is further away than the best match so
+// far, so on natural images most of the library is never looked at.
+
+#ifndef INFINIPIC_VPTREE_H_
+#define INFINIPIC_VPTREE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace match {
+
+class VpTree {
+ public:
+  // Index count points of dims bytes each, where point i starts at
+  // base + i * stride.  The points are not copied and must outlive the tree.
+  VpTree(const uint8_t* base, size_t stride, int count, int dims);
+
+  // Return the index of the point with the smallest SSD to query, ties going
+  // to the lowest index, or -1 if the tree is empty.  This is always the same
+  // point an exhaustive scan would find.  The number of bytes compared is
+  // added to *examined.
+  int FindClosest(const uint8_t* query, uint64_t* examined) const;
+
+  // Bytes of memory used by the tree itself, not counting the points.
+  size_t MemoryUsage() const;
+
+ private:
+  struct Node {
+    // Points in this subtree are order_[begin, end), with the vantage point
+    // at begin.  Leaves have no vantage point, and children set to -1.
+    int begin;
+    int end;
+    // Points within radius of the vantage point are in inside, the rest in
+    // outside.
+    double radius;
+    int inside;
+    int outside;
+  };
+
+  struct BuildState;
+  struct Query;
+
+  const uint8_t* point(int i) const { return base_ + i * stride_; }
+
+  int Build(int begin, int end, BuildState* state);
+  void Search(int node, Query* query) const;
+
+  const uint8_t* base_;
+  size_t stride_;
+  int dims_;
+  std::vector<int> order_;
+  std::vector<Node> nodes_;
+};
+
+}  // namespace match
+
+#endif  // INFINIPIC_VPTREE_H_
@@ -1,9 +1,13 @@
 #include "window.h"
 
+#include <cstdint>
 #include <iostream>
 
 #include <GL/gl.h>
 #include <GL/glx.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 namespace graphics {
 
@@ -17,6 +21,8 @@ struct GLWindow {
   unsigned int            bpp;
   int                     x,y;
   unsigned int            width, height;
+  // Written by Invalidate() to wake up the event loop.
+  int                     wake_fd;
 };
 
 // Create a new GLX window with the desired width and height, and return
@@ -98,6 +104,8 @@ GLWindow* CreateGLWindow(const int width, const int height,
                &gl_win->x, &gl_win->y,
                &gl_win->width, &gl_win->height,
                &border_dummy, &gl_win->bpp);
+
+  gl_win->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
   
   return gl_win;
 }
@@ -114,11 +122,13 @@ void DestroyGLWindow(GLWindow* gl_win) {
 
   // Close the display connection.
   XCloseDisplay(gl_win->dpy);
+  close(gl_win->wake_fd);
 }
 
 Window::Window(int width, int height, const std::string& title)
     : gl_win_(CreateGLWindow(width, height, title)),
-      running_(false) {
+      running_(false),
+      invalidated_(true) {
 }
 
 Window::~Window() {
@@ -141,10 +151,14 @@ void Window::Run() {
   running_ = true;
   while (running_) {
     // Handle any pending events.
+    bool damaged = invalidated_.exchange(false);
     while (XPending(gl_win_->dpy) > 0) {
       XEvent event;
       XNextEvent(gl_win_->dpy, &event);
       switch (event.type) {
+        case Expose:
+          damaged = true;
+          break;
         case ConfigureNotify:
           if ((static_cast<unsigned int>(event.xconfigure.width) !=
                gl_win_->width) ||
@@ -153,6 +167,7 @@ void Window::Run() {
             gl_win_->width = event.xconfigure.width;
             gl_win_->height = event.xconfigure.height;
             Resize(gl_win_->width, gl_win_->height);
+            damaged = true;
           }
           break;
         case ClientMessage:
@@ -165,12 +180,48 @@ void Window::Run() {
           KeySym keysym;
           XLookupString(&event.xkey, nullptr, 0, &keysym, nullptr);
           Keypress(keysym);
+          damaged = true;
+          break;
+        case ButtonPress:
+          Buttonpress(event.xbutton.button, event.xbutton.x,
+                      event.xbutton.y);
+          damaged = true;
           break;
       }
     }
+    if (!running_) {
+      break;
+    }
+
+    if (damaged) {
+      Draw();
+      glXSwapBuffers(gl_win_->dpy, gl_win_->win);
+    } else {
+      WaitForEvents();
+    }
+  }
+}
 
-    Draw();
-    glXSwapBuffers(gl_win_->dpy, gl_win_->win);
+void Window::Invalidate() {
+  invalidated_ = true;
+  uint64_t one = 1;
+  if (write(gl_win_->wake_fd, &one, sizeof(one)) < 0) {
+    // The counter is already non-zero, so the loop wakes up anyway.
+  }
+}
+
+void Window::WaitForEvents() {
+  pollfd fds[2];
+  fds[0].fd = ConnectionNumber(gl_win_->dpy);
+  fds[0].events = POLLIN;
+  fds[1].fd = gl_win_->wake_fd;
+  fds[1].events = POLLIN;
+  poll(fds, 2, -1);
+  if (fds[1].revents & POLLIN) {
+    uint64_t count;
+    if (read(gl_win_->wake_fd, &count, sizeof(count)) < 0) {
+      // Someone else reset the counter.
+    }
   }
 }
 
@@ -179,6 +230,9 @@ bool Window::Init() {
   return true;
 }
 
+void Window::Buttonpress(unsigned int button, int x, int y) {
+}
+
 void Window::Close() {
   running_ = false;
 }
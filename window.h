@@ -4,13 +4,17 @@
 //   Init(): called before entering the main application loop.
 //   Resize(): called after a resize event (easiest to use defaults)
 //   Keypress(): called whenever a key is _pressed_ (not released)
-//   Draw(): called after handling all events
+//   Buttonpress(): called whenever a mouse button is pressed
+//   Draw(): called after handling events that need a redraw
 // 
 // The classes provided in this file are:
 // Window - A bare bones abstract class that handles an event loop.
 // Window2d - Sets up an orthographic projection with pixel coordinates
 //   in the rectangle (0, 0) - (width, height)
 //
+// The event loop sleeps until there is an event, and only redraws when the
+// window was exposed, resized, got input, or Invalidate() was called.
+//
 // To use, inherit from one of these classes, and implement any missing virtual
 // functions.  Then, simply create your window and call run:
 // MyWindow window(800, 600, "A program");
@@ -19,6 +23,7 @@
 #ifndef INFINIPIC_WINDOW_H_
 #define INFINIPIC_WINDOW_H_
 
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -36,11 +41,13 @@ class Window {
   virtual ~Window();
 
   // Start running the application.  Starts off by calling Init(), Resize(),
-  // and then enters an event handling loop, each loop calling Draw().
-  // The event handler finishes either when Close() is called, or when the
-  // window is closed externally.
+  // and then enters an event handling loop, calling Draw() whenever the
+  // window needs to be redrawn.  The event handler finishes either when
+  // Close() is called, or when the window is closed externally.
   void Run();
 
+  // Redraw the window soon.  May be called from any thread.
+  void Invalidate();
  protected:
   // For initializing any application state or OpenGL stuff.
   virtual bool Init();
@@ -51,6 +58,10 @@ class Window {
   // Handle the initial press of a key.  The key code is an X11 KeySym.
   virtual void Keypress(unsigned int key) = 0;
 
+  // Handle the press of a mouse button, at x and y pixels from the top left
+  // of the window.  Buttons 4 and 5 are the scroll wheel.
+  virtual void Buttonpress(unsigned int button, int x, int y);
+
   // Handle redrawing the frame.
   virtual void Draw() = 0;
 
@@ -63,8 +74,12 @@ class Window {
   int height() const;
   
  private:
+  // Wait until there are events, or Invalidate() is called.
+  void WaitForEvents();
+
   std::unique_ptr<GLWindow> gl_win_;
   bool running_;
+  std::atomic<bool> invalidated_;
 };
 
 class Window2d : public Window {